@@ -46,7 +46,13 @@ build_binary() {
   wget -q "$HEADERS_URL/pnglibconf.h" -O pnglibconf.h
   wget -q "$SOURCE_FILE_URL" -O screenshot.cpp
 
-  g++ -std=c++17 -O2 -o "$BINARY_NAME" screenshot.cpp -I. /usr/lib/libpng16.so.16.36.0
+  CXXFLAGS="-std=c++17 -O2"
+  # enable the NEON conversion kernels on 32-bit ARM (Cortex-A7 on the TXT 4.0)
+  case "$(uname -m)" in
+    armv7*) CXXFLAGS="$CXXFLAGS -mfpu=neon-vfpv4" ;;
+  esac
+
+  g++ $CXXFLAGS -pthread -o "$BINARY_NAME" screenshot.cpp -I. /usr/lib/libpng16.so.16.36.0
   if [ $? -ne 0 ]; then
     echo "Failed to build binary."
     exit 1
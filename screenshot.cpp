@@ -28,206 +28,5258 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cerrno>
 #include <charconv>
+#include <chrono>
+#include <csignal>
 #include <cstddef>
 #include <cstdint>
+#include <condition_variable>
+#include <cstring>
 #include <ctime>
-#include <fstream>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
 #include <getopt.h>
+#include <iomanip>
 #include <iostream>
+#include <linux/fb.h>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <png.h>
+#include <poll.h>
 #include <string>
 #include <string_view>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
-// Config TXT 4.0 display
-constexpr auto WIDTH = 240UL;
-constexpr auto HEIGHT = 320UL;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCREENSHOT_X86_SIMD 1
+#endif
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define SCREENSHOT_IO_URING 1
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCREENSHOT_NEON 1
+#if defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+// Config TXT 4.0 display (used when the device does not report its geometry, e.g. raw dumps)
+constexpr auto WIDTH = 240U;
+constexpr auto HEIGHT = 320U;
+constexpr auto BITS_PER_PIXEL = 16U;
 constexpr auto FRAME_BUF_PATH = "/dev/fb0";
 
-// String buffer sizes
-constexpr auto DATE_STR_SIZE = 20;
-constexpr auto COUNTER_STR_SIZE = 10;
+// Default period of the continuous capture mode
+constexpr auto DEFAULT_INTERVAL_MS = 1000U;
+
+// Captured frames waiting for the encoder in continuous mode
+constexpr auto DEFAULT_QUEUE_DEPTH = 4U;
+
+// Frames with at most this many colors are written as palette images
+constexpr auto MAX_PALETTE_SIZE = 256U;
+
+// Edge length in pixels of the tiles used to share unchanged image regions between frames
+constexpr auto TILE_SIZE = 16U;
+
+// Attempts to get two identical reads when the driver cannot wait for vsync
+constexpr auto MAX_TEAR_RETRIES = 8;
+
+// String buffer sizes
+constexpr auto DATE_STR_SIZE = 20;
+constexpr auto COUNTER_STR_SIZE = 10;
+constexpr auto COMMAND_STR_SIZE = 16;
+
+// Constants for color conversion (RGB565 to RGB888)
+constexpr auto RED_MAX = 31;
+constexpr auto GREEN_MAX = 63;
+constexpr auto BLUE_MAX = 31;
+constexpr auto COLOR_MAX = 255;
+
+struct RGB565 {
+    uint16_t blue : 5;
+    uint16_t green : 6;
+    uint16_t red : 5;
+};
+
+struct RGB888 {
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+};
+
+// The conversion kernels rely on both pixel types being tightly packed
+static_assert(sizeof(RGB565) == 2 && sizeof(RGB888) == 3);
+
+// Lookup table expanding a channel of `Max + 1` levels to 8 bits as `value * COLOR_MAX / Max`
+template <int Max> constexpr auto makeExpansionTable() -> std::array<unsigned char, Max + 1> {
+    auto table = std::array<unsigned char, Max + 1>();
+    for (auto value = 0; value <= Max; ++value) {
+        table[static_cast<size_t>(value)] = static_cast<unsigned char>(value * COLOR_MAX / Max);
+    }
+    return table;
+}
+
+constexpr auto RED_TABLE = makeExpansionTable<RED_MAX>();
+constexpr auto GREEN_TABLE = makeExpansionTable<GREEN_MAX>();
+constexpr auto BLUE_TABLE = makeExpansionTable<BLUE_MAX>();
+
+static_assert(RED_TABLE[RED_MAX] == COLOR_MAX && RED_TABLE[1] == 8 && RED_TABLE[30] == 246);
+static_assert(GREEN_TABLE[GREEN_MAX] == COLOR_MAX && GREEN_TABLE[1] == 4 && GREEN_TABLE[62] == 250);
+
+// Pixel formats with specialized converters (see the conversion engine below)
+enum class PixelFormat : uint8_t { Rgb565, Bgr565, Xrgb8888, Argb8888, Rgb888, Rgba8888, Gray8 };
+
+/**
+ * Pixel layout of a frame buffer as reported by the fbdev driver.
+ *
+ * Channels are described by their bit offset and length inside a native-endian pixel value of
+ * `bitsPerPixel` bits, and rows are `stride` bytes apart.
+ */
+struct FrameFormat {
+    uint32_t width = WIDTH;
+    uint32_t height = HEIGHT;
+    uint32_t bitsPerPixel = BITS_PER_PIXEL;
+    uint32_t stride = WIDTH * BITS_PER_PIXEL / 8;
+    fb_bitfield red = {11, 5, 0};
+    fb_bitfield green = {5, 6, 0};
+    fb_bitfield blue = {0, 5, 0};
+    fb_bitfield transp = {0, 0, 0};
+
+    [[nodiscard]] auto bytesPerPixel() const -> uint32_t { return bitsPerPixel / 8; }
+
+    // The layout as one of the formats with a specialized converter, if it is one
+    [[nodiscard]] auto pixelFormat() const -> std::optional<PixelFormat> {
+        auto is = [](const fb_bitfield& field, uint32_t offset, uint32_t length) {
+            return field.offset == offset && field.length == length;
+        };
+        if (bitsPerPixel == 16 && is(green, 5, 6)) {
+            if (is(red, 11, 5) && is(blue, 0, 5)) {
+                return PixelFormat::Rgb565;
+            }
+            if (is(blue, 11, 5) && is(red, 0, 5)) {
+                return PixelFormat::Bgr565;
+            }
+        }
+        if (bitsPerPixel == 32 && is(red, 16, 8) && is(green, 8, 8) && is(blue, 0, 8)) {
+            return is(transp, 24, 8) ? PixelFormat::Argb8888 : PixelFormat::Xrgb8888;
+        }
+        if (bitsPerPixel == 32 && is(red, 0, 8) && is(green, 8, 8) && is(blue, 16, 8) &&
+            is(transp, 24, 8)) {
+            return PixelFormat::Rgba8888;
+        }
+        if (bitsPerPixel == 24 && is(red, 0, 8) && is(green, 8, 8) && is(blue, 16, 8)) {
+            return PixelFormat::Rgb888;
+        }
+        return std::nullopt;
+    }
+
+    // 8 bits per channel at byte-aligned positions, e.g. XRGB8888 or BGR888
+    [[nodiscard]] auto isByteAligned() const -> bool {
+        auto aligned = [](const fb_bitfield& field) {
+            return field.length == 8 && field.offset % 8 == 0;
+        };
+        return (bitsPerPixel == 24 || bitsPerPixel == 32) && aligned(red) && aligned(green) &&
+               aligned(blue);
+    }
+};
+
+// Pixels of a single frame; rows start `format.stride` bytes apart
+struct FrameView {
+    const unsigned char* pixels = nullptr;
+    FrameFormat format;
+
+    [[nodiscard]] auto row(uint32_t y) const -> const unsigned char* {
+        return pixels + static_cast<size_t>(y) * format.stride;
+    }
+};
+
+auto getDate(time_t timestamp) -> std::array<char, DATE_STR_SIZE> {
+    auto* ltm = localtime(&timestamp); // NOLINT (ignore thread unsafety)
+
+    auto date = std::array<char, DATE_STR_SIZE>();
+    (void)strftime(date.data(), sizeof(date), "%Y-%m-%d-%H-%M-%S", ltm);
+    return date;
+}
+
+// Bytes reserved for headers and chunk framing on top of the pixel data of an encoded file
+constexpr auto ENCODED_HEADROOM = size_t{4096};
+
+// Where an encoded file goes: a path, or a descriptor that is already open (standard output, a
+// pipe or a socket)
+struct Output {
+    std::string path;
+    int fd = -1;
+    bool exclusive = false; // a generated name, which must not replace an existing file
+
+    [[nodiscard]] auto name() const -> std::string {
+        if (fd < 0) {
+            return path;
+        }
+        return fd == STDOUT_FILENO ? "standard output" : "fd " + std::to_string(fd);
+    }
+};
+
+/**
+ * Read-only memory mapping of the frame buffer device.
+ *
+ * The device is mapped once and the pixels are handed to the conversion stage directly, so a
+ * capture costs neither an iostream copy nor a heap allocation.
+ */
+class FrameBuffer {
+  public:
+    FrameBuffer() = default;
+    FrameBuffer(const FrameBuffer&) = delete;
+    auto operator=(const FrameBuffer&) -> FrameBuffer& = delete;
+    FrameBuffer(FrameBuffer&&) = delete;
+    auto operator=(FrameBuffer&&) -> FrameBuffer& = delete;
+    ~FrameBuffer() { close(); }
+
+    auto open(const char* path) -> bool {
+        close();
+
+        fd = ::open(path, O_RDONLY | O_CLOEXEC); // NOLINT (vararg C API)
+        if (fd < 0) {
+            std::cerr << "Failed to open frame buffer\n";
+            return false;
+        }
+
+        if (not queryFormat()) {
+            close();
+            return false;
+        }
+
+        // a regular file (e.g. a raw dump) that is too short would fault on access
+        struct stat info {};
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+            static_cast<size_t>(info.st_size) < mapSize) {
+            std::cerr << "Failed to read frame buffer\n";
+            close();
+            return false;
+        }
+
+        map = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) { // NOLINT (MAP_FAILED is a C-style cast)
+            map = nullptr;
+            std::cerr << "Failed to map frame buffer\n";
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    auto close() -> void {
+        if (map != nullptr) {
+            munmap(map, mapSize);
+            map = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    [[nodiscard]] auto format() const -> const FrameFormat& { return fmt; }
+
+    // Zero-copy view of the frame currently on screen (honoring the panning offset)
+    auto view() -> FrameView {
+        updatePanning();
+        return liveView();
+    }
+
+    /**
+     * Tear-free copy of the frame currently on screen.
+     *
+     * Waits for the next vsync and copies the visible area right away. Drivers without
+     * FBIO_WAITFORVSYNC fall back to copying until the copy matches the live frame. The returned
+     * view stays valid until the next call.
+     */
+    auto snapshot() -> FrameView {
+        if (vsyncSupported) {
+            auto zero = uint32_t{0};
+            if (ioctl(fd, FBIO_WAITFORVSYNC, &zero) == 0) { // NOLINT (vararg C API)
+                updatePanning();
+                copyVisible(liveView());
+                return snapshotView();
+            }
+            vsyncSupported = false;
+        }
+
+        auto live = view();
+        for (auto attempt = 0; attempt < MAX_TEAR_RETRIES; ++attempt) {
+            copyVisible(live);
+            if (matchesVisible(live)) {
+                return snapshotView();
+            }
+            live = view();
+        }
+        std::cerr << "Frame buffer kept changing, the screenshot may be torn\n";
+        return snapshotView();
+    }
+
+  private:
+    // Query geometry and pixel layout; devices without fbdev ioctls get the TXT 4.0 defaults
+    auto queryFormat() -> bool {
+        fmt = FrameFormat();
+
+        auto var = fb_var_screeninfo{};
+        auto fix = fb_fix_screeninfo{};
+        if (ioctl(fd, FBIOGET_VSCREENINFO, &var) != 0 || // NOLINT (vararg C API)
+            ioctl(fd, FBIOGET_FSCREENINFO, &fix) != 0) {  // NOLINT (vararg C API)
+            if (errno != ENOTTY) {
+                std::cerr << "Failed to query frame buffer: " << strerror(errno) << "\n";
+                return false;
+            }
+            mapSize = static_cast<size_t>(fmt.stride) * fmt.height;
+            hasIoctls = false;
+            vsyncSupported = false;
+            return true;
+        }
+
+        if (var.bits_per_pixel != 16 && var.bits_per_pixel != 24 && var.bits_per_pixel != 32) {
+            std::cerr << "Unsupported frame buffer depth: " << var.bits_per_pixel << " bpp\n";
+            return false;
+        }
+
+        fmt.width = var.xres;
+        fmt.height = var.yres;
+        fmt.bitsPerPixel = var.bits_per_pixel;
+        fmt.stride =
+            fix.line_length != 0 ? fix.line_length : var.xres_virtual * fmt.bytesPerPixel();
+        fmt.red = var.red;
+        fmt.green = var.green;
+        fmt.blue = var.blue;
+        fmt.transp = var.transp;
+
+        mapSize = fix.smem_len != 0 ? fix.smem_len : static_cast<size_t>(fmt.stride) * fmt.height;
+        if (static_cast<size_t>(fmt.stride) * fmt.height > mapSize) {
+            std::cerr << "Frame buffer memory is smaller than the visible area\n";
+            return false;
+        }
+        hasIoctls = true;
+        vsyncSupported = true;
+        return true;
+    }
+
+    // Double-buffering drivers flip between pages by panning inside the virtual screen
+    auto updatePanning() -> void {
+        auto var = fb_var_screeninfo{};
+        if (not hasIoctls || ioctl(fd, FBIOGET_VSCREENINFO, &var) != 0) { // NOLINT (vararg)
+            return;
+        }
+        auto offset = static_cast<size_t>(var.yoffset) * fmt.stride +
+                      static_cast<size_t>(var.xoffset) * fmt.bytesPerPixel();
+        if (offset + static_cast<size_t>(fmt.stride) * fmt.height <= mapSize) {
+            panOffset = offset;
+        }
+    }
+
+    [[nodiscard]] auto liveView() const -> FrameView {
+        return FrameView{static_cast<const unsigned char*>(map) + panOffset, fmt};
+    }
+
+    [[nodiscard]] auto snapshotView() const -> FrameView {
+        auto format = fmt;
+        format.stride = fmt.width * fmt.bytesPerPixel();
+        return FrameView{snapshotBuf.data(), format};
+    }
+
+    auto copyVisible(const FrameView& live) -> void {
+        auto rowSize = static_cast<size_t>(fmt.width) * fmt.bytesPerPixel();
+        snapshotBuf.resize(rowSize * fmt.height);
+        if (rowSize == fmt.stride) {
+            std::memcpy(snapshotBuf.data(), live.pixels, snapshotBuf.size());
+            return;
+        }
+        for (auto y = 0U; y < fmt.height; ++y) {
+            std::memcpy(&snapshotBuf[y * rowSize], live.row(y), rowSize);
+        }
+    }
+
+    [[nodiscard]] auto matchesVisible(const FrameView& live) const -> bool {
+        auto rowSize = static_cast<size_t>(fmt.width) * fmt.bytesPerPixel();
+        for (auto y = 0U; y < fmt.height; ++y) {
+            if (std::memcmp(&snapshotBuf[y * rowSize], live.row(y), rowSize) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int fd = -1;
+    void* map = nullptr;
+    size_t mapSize = 0;
+    size_t panOffset = 0;
+    bool hasIoctls = false;
+    bool vsyncSupported = false;
+    FrameFormat fmt;
+    std::vector<unsigned char> snapshotBuf;
+};
+
+// Pixel rectangle inside a frame
+struct Rect {
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+
+    [[nodiscard]] auto empty() const -> bool { return width == 0 || height == 0; }
+};
+
+// Smallest rectangle covering both; an empty one adds nothing
+auto unite(const Rect& a, const Rect& b) -> Rect {
+    if (a.empty()) {
+        return b;
+    }
+    if (b.empty()) {
+        return a;
+    }
+    auto x = std::min(a.x, b.x);
+    auto y = std::min(a.y, b.y);
+    auto right = std::max(a.x + a.width, b.x + b.width);
+    auto bottom = std::max(a.y + a.height, b.y + b.height);
+    return Rect{x, y, right - x, bottom - y};
+}
+
+// Frames are compared in TILE_SIZE x TILE_SIZE tiles; tiles on the right and bottom edge may be
+// smaller
+auto tileCount(uint32_t pixels) -> uint32_t { return (pixels + TILE_SIZE - 1) / TILE_SIZE; }
+
+auto tileBounds(const FrameFormat& format, uint32_t tx, uint32_t ty) -> Rect {
+    auto x = tx * TILE_SIZE;
+    auto y = ty * TILE_SIZE;
+    return Rect{
+        x, y, std::min(TILE_SIZE, format.width - x), std::min(TILE_SIZE, format.height - y)
+    };
+}
+
+// The pixels of `rect` inside `frame`, sharing its memory
+auto crop(const FrameView& frame, const Rect& rect) -> FrameView {
+    auto view = frame;
+    view.pixels = frame.row(rect.y) + static_cast<size_t>(rect.x) * frame.format.bytesPerPixel();
+    view.format.width = rect.width;
+    view.format.height = rect.height;
+    return view;
+}
+
+/**
+ * Detects which tiles of a frame changed since the previous frame.
+ *
+ * Every tile is reduced to a 64-bit hash, so only the hashes of the previous frame are kept and
+ * comparing costs one sequential read of the new frame.
+ */
+class DirtyTracker {
+  public:
+    // Compare the frame with the previous one; returns the bounding rectangle of changed tiles
+    auto update(const FrameView& frame) -> Rect {
+        const auto& format = frame.format;
+        auto sameGeometry = format.width == width && format.height == height &&
+                            format.bitsPerPixel == bitsPerPixel;
+        width = format.width;
+        height = format.height;
+        bitsPerPixel = format.bitsPerPixel;
+        tilesX = tileCount(width);
+        tilesY = tileCount(height);
+        hashes.resize(static_cast<size_t>(tilesX) * tilesY);
+        changed.assign(hashes.size(), 0);
+
+        auto minX = tilesX;
+        auto minY = tilesY;
+        auto maxX = 0U;
+        auto maxY = 0U;
+        for (auto ty = 0U; ty < tilesY; ++ty) {
+            for (auto tx = 0U; tx < tilesX; ++tx) {
+                auto index = static_cast<size_t>(ty) * tilesX + tx;
+                auto hash = hashTile(frame, tileBounds(format, tx, ty));
+                if (sameGeometry && hashes[index] == hash) {
+                    continue;
+                }
+                hashes[index] = hash;
+                changed[index] = 1;
+                minX = std::min(minX, tx);
+                minY = std::min(minY, ty);
+                maxX = std::max(maxX, tx);
+                maxY = std::max(maxY, ty);
+            }
+        }
+
+        if (minX > maxX) {
+            return Rect{};
+        }
+        auto topLeft = tileBounds(format, minX, minY);
+        auto bottomRight = tileBounds(format, maxX, maxY);
+        return Rect{
+            topLeft.x,
+            topLeft.y,
+            bottomRight.x + bottomRight.width - topLeft.x,
+            bottomRight.y + bottomRight.height - topLeft.y,
+        };
+    }
+
+    // Whether tile `index` (row-major) changed in the last update()
+    [[nodiscard]] auto tileChanged(size_t index) const -> bool { return changed[index] != 0; }
+
+  private:
+    static auto hashTile(const FrameView& frame, const Rect& tile) -> uint64_t {
+        constexpr auto prime = 0x9E3779B97F4A7C15ULL;
+        auto bpp = frame.format.bytesPerPixel();
+        auto rowSize = static_cast<size_t>(tile.width) * bpp;
+        auto hash = uint64_t{0};
+        for (auto y = tile.y; y < tile.y + tile.height; ++y) {
+            const auto* row = frame.row(y) + static_cast<size_t>(tile.x) * bpp;
+            auto i = size_t{0};
+            for (; i + sizeof(uint64_t) <= rowSize; i += sizeof(uint64_t)) {
+                auto word = uint64_t{0};
+                std::memcpy(&word, row + i, sizeof(word));
+                hash = (hash ^ word) * prime;
+                hash ^= hash >> 29U;
+            }
+            if (i < rowSize) {
+                auto word = uint64_t{0};
+                std::memcpy(&word, row + i, rowSize - i);
+                hash = (hash ^ word) * prime;
+                hash ^= hash >> 29U;
+            }
+        }
+        return hash;
+    }
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t bitsPerPixel = 0;
+    uint32_t tilesX = 0;
+    uint32_t tilesY = 0;
+    std::vector<uint64_t> hashes;
+    std::vector<unsigned char> changed;
+};
+
+// Straight per-pixel formula; the reference all other kernels must match byte for byte
+auto convertRgb565ToRgb888Reference(const RGB565* buffer565, RGB888* buffer888, size_t count)
+    -> void {
+    for (size_t i = 0; i < count; ++i) {
+        buffer888[i].red = static_cast<unsigned char>(buffer565[i].red * COLOR_MAX / RED_MAX);
+        buffer888[i].green =
+            static_cast<unsigned char>(buffer565[i].green * COLOR_MAX / GREEN_MAX);
+        buffer888[i].blue = static_cast<unsigned char>(buffer565[i].blue * COLOR_MAX / BLUE_MAX);
+    }
+}
+
+auto convertRgb565ToRgb888Scalar(const RGB565* buffer565, RGB888* buffer888, size_t count)
+    -> void {
+    for (size_t i = 0; i < count; ++i) {
+        buffer888[i].red = RED_TABLE[buffer565[i].red];
+        buffer888[i].green = GREEN_TABLE[buffer565[i].green];
+        buffer888[i].blue = BLUE_TABLE[buffer565[i].blue];
+    }
+}
+
+/*
+ * The vector kernels compute `channel * 255 / max` (truncating) as the high half of a 16-bit
+ * multiplication, which is exact for every 5- and 6-bit input:
+ *   red, blue: ((c << 9) * 1053) >> 16
+ *   green:     ((c << 6) * 4145) >> 16
+ * so they produce exactly the bytes of the scalar kernel.
+ */
+constexpr auto RED_BLUE_MULTIPLIER = 1053;
+constexpr auto GREEN_MULTIPLIER = 4145;
+
+#if defined(SCREENSHOT_X86_SIMD)
+// NOLINTBEGIN: intrinsics take their operands through casted pointers
+
+// Store 4 RGBX pixels as 12 RGB bytes; writes 2 bytes past the end
+__attribute__((target("sse2"))) inline auto storeRgbxAsRgbSse2(unsigned char* out, __m128i rgbx)
+    -> void {
+    // squeeze the padding byte out of each pair of pixels within a 64-bit lane
+    auto low = _mm_and_si128(rgbx, _mm_set1_epi64x(0x0000000000FFFFFFLL));
+    auto high = _mm_and_si128(_mm_srli_epi64(rgbx, 8), _mm_set1_epi64x(0x0000FFFFFF000000LL));
+    auto packed = _mm_or_si128(low, high);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), packed);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 6), _mm_srli_si128(packed, 8));
+}
+
+__attribute__((target("sse2"))) auto
+convertRgb565ToRgb888Sse2(const RGB565* buffer565, RGB888* buffer888, size_t count) -> void {
+    auto* out = reinterpret_cast<unsigned char*>(buffer888);
+    auto i = size_t{0};
+    // keep one pixel for the scalar tail so the overlapping stores stay inside the buffer
+    for (; i + 8 < count; i += 8) {
+        auto pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buffer565 + i));
+        auto red = _mm_mulhi_epu16(
+            _mm_and_si128(_mm_srli_epi16(pixels, 2), _mm_set1_epi16(0x3E00)),
+            _mm_set1_epi16(RED_BLUE_MULTIPLIER)
+        );
+        auto green = _mm_mulhi_epu16(
+            _mm_slli_epi16(_mm_and_si128(pixels, _mm_set1_epi16(0x07E0)), 1),
+            _mm_set1_epi16(GREEN_MULTIPLIER)
+        );
+        auto blue = _mm_mulhi_epu16(
+            _mm_slli_epi16(_mm_and_si128(pixels, _mm_set1_epi16(0x001F)), 9),
+            _mm_set1_epi16(RED_BLUE_MULTIPLIER)
+        );
+        // 32-bit RGBX pixels, red in the lowest byte
+        auto redGreen = _mm_or_si128(red, _mm_slli_epi16(green, 8));
+        storeRgbxAsRgbSse2(out + i * 3, _mm_unpacklo_epi16(redGreen, blue));
+        storeRgbxAsRgbSse2(out + i * 3 + 12, _mm_unpackhi_epi16(redGreen, blue));
+    }
+    convertRgb565ToRgb888Scalar(buffer565 + i, buffer888 + i, count - i);
+}
+
+__attribute__((target("avx2"))) auto
+convertRgb565ToRgb888Avx2(const RGB565* buffer565, RGB888* buffer888, size_t count) -> void {
+    auto* out = reinterpret_cast<unsigned char*>(buffer888);
+    // drop the padding byte of each RGBX pixel inside both 128-bit lanes
+    auto compact = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+    );
+    auto i = size_t{0};
+    // keep two pixels for the scalar tail so the overlapping stores stay inside the buffer
+    for (; i + 16 + 2 <= count; i += 16) {
+        auto pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buffer565 + i));
+        auto red = _mm256_mulhi_epu16(
+            _mm256_and_si256(_mm256_srli_epi16(pixels, 2), _mm256_set1_epi16(0x3E00)),
+            _mm256_set1_epi16(RED_BLUE_MULTIPLIER)
+        );
+        auto green = _mm256_mulhi_epu16(
+            _mm256_slli_epi16(_mm256_and_si256(pixels, _mm256_set1_epi16(0x07E0)), 1),
+            _mm256_set1_epi16(GREEN_MULTIPLIER)
+        );
+        auto blue = _mm256_mulhi_epu16(
+            _mm256_slli_epi16(_mm256_and_si256(pixels, _mm256_set1_epi16(0x001F)), 9),
+            _mm256_set1_epi16(RED_BLUE_MULTIPLIER)
+        );
+        auto redGreen = _mm256_or_si256(red, _mm256_slli_epi16(green, 8));
+        // unpack works per 128-bit lane: low holds pixels 0-3 and 8-11, high 4-7 and 12-15
+        auto low = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(redGreen, blue), compact);
+        auto high = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(redGreen, blue), compact);
+        auto* dst = out + i * 3;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm256_castsi256_si128(low));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 12), _mm256_castsi256_si128(high));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 24), _mm256_extracti128_si256(low, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 36), _mm256_extracti128_si256(high, 1));
+    }
+    convertRgb565ToRgb888Scalar(buffer565 + i, buffer888 + i, count - i);
+}
+// NOLINTEND
+#endif
+
+#if defined(SCREENSHOT_NEON)
+// NOLINTBEGIN: intrinsics take their operands through casted pointers
+auto convertRgb565ToRgb888Neon(const RGB565* buffer565, RGB888* buffer888, size_t count) -> void {
+    auto* out = reinterpret_cast<unsigned char*>(buffer888);
+    auto i = size_t{0};
+    for (; i + 8 <= count; i += 8) {
+        auto pixels = vld1q_u16(reinterpret_cast<const uint16_t*>(buffer565 + i));
+        auto red = vshrq_n_u16(vmulq_n_u16(vshrq_n_u16(pixels, 11), RED_BLUE_MULTIPLIER), 7);
+        auto blue = vshrq_n_u16(
+            vmulq_n_u16(vandq_u16(pixels, vdupq_n_u16(0x1F)), RED_BLUE_MULTIPLIER), 7
+        );
+        // 6 bits times 4145 needs 32-bit products
+        auto green6 = vandq_u16(vshrq_n_u16(pixels, 5), vdupq_n_u16(0x3F));
+        auto green = vcombine_u16(
+            vshrn_n_u32(vmull_n_u16(vget_low_u16(green6), GREEN_MULTIPLIER), 10),
+            vshrn_n_u32(vmull_n_u16(vget_high_u16(green6), GREEN_MULTIPLIER), 10)
+        );
+        auto rgb = uint8x8x3_t{{vmovn_u16(red), vmovn_u16(green), vmovn_u16(blue)}};
+        vst3_u8(out + i * 3, rgb);
+    }
+    convertRgb565ToRgb888Scalar(buffer565 + i, buffer888 + i, count - i);
+}
+// NOLINTEND
+
+auto cpuHasNeon() -> bool {
+#if defined(__arm__)
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+    return true; // mandatory on AArch64
+#endif
+}
+#endif
+
+using Rgb565Converter = void (*)(const RGB565*, RGB888*, size_t);
+
+struct Rgb565Kernel {
+    const char* name;
+    Rgb565Converter convert;
+};
+
+// RGB565 to RGB888 kernels supported by this CPU, fastest first; the scalar kernel is always last
+auto rgb565Kernels() -> const std::vector<Rgb565Kernel>& {
+    static const auto kernels = [] {
+        auto list = std::vector<Rgb565Kernel>();
+#if defined(SCREENSHOT_X86_SIMD)
+        if (__builtin_cpu_supports("avx2")) {
+            list.push_back({"avx2", convertRgb565ToRgb888Avx2});
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            list.push_back({"sse2", convertRgb565ToRgb888Sse2});
+        }
+#endif
+#if defined(SCREENSHOT_NEON)
+        if (cpuHasNeon()) {
+            list.push_back({"neon", convertRgb565ToRgb888Neon});
+        }
+#endif
+        list.push_back({"scalar", convertRgb565ToRgb888Scalar});
+        return list;
+    }();
+    return kernels;
+}
+
+auto convertRgb565ToRgb888(const RGB565* buffer565, RGB888* buffer888, size_t count) -> void {
+    static const auto convert = rgb565Kernels().front().convert;
+    convert(buffer565, buffer888, count);
+}
+
+// 8-bit channels only need to be picked out of the pixel, no scaling involved
+auto convertByteAlignedToRgb888(
+    const unsigned char* row, RGB888* buffer888, size_t count, const FrameFormat& format
+) -> void {
+    auto bpp = format.bytesPerPixel();
+    auto redByte = format.red.offset / 8;
+    auto greenByte = format.green.offset / 8;
+    auto blueByte = format.blue.offset / 8;
+    for (size_t i = 0; i < count; ++i, row += bpp) {
+        buffer888[i].red = row[redByte];
+        buffer888[i].green = row[greenByte];
+        buffer888[i].blue = row[blueByte];
+    }
+}
+
+// Any other layout: extract each channel through its bit field and scale it to 8 bits
+auto convertGenericToRgb888(
+    const unsigned char* row, RGB888* buffer888, size_t count, const FrameFormat& format
+) -> void {
+    auto expand = [](uint32_t pixel, const fb_bitfield& field) {
+        auto max = field.length >= 32 ? UINT32_MAX : (1U << field.length) - 1U;
+        if (max == 0) {
+            return static_cast<unsigned char>(0);
+        }
+        auto value = (pixel >> field.offset) & max;
+        return static_cast<unsigned char>(uint64_t{value} * COLOR_MAX / max);
+    };
+
+    auto bpp = format.bytesPerPixel();
+    for (size_t i = 0; i < count; ++i, row += bpp) {
+        auto pixel = uint32_t{0};
+        std::memcpy(&pixel, row, bpp); // native (little) endian pixel value
+        buffer888[i].red = expand(pixel, format.red);
+        buffer888[i].green = expand(pixel, format.green);
+        buffer888[i].blue = expand(pixel, format.blue);
+    }
+}
+
+/*
+ * Pixel format conversion engine.
+ *
+ * Every format is a traits struct that loads a pixel into 8-bit RGBA and stores one back. For each
+ * (source, destination) pair convertRow<> is instantiated at compile time, so the per-pixel code
+ * is fully inlined; the runtime only picks a function pointer from ROW_CONVERTERS. Multi-byte
+ * pixel values are native endian, like the frame buffer itself, while RGB888/RGBA8888 are byte
+ * sequences in the order PNG expects.
+ */
+struct Rgba {
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+    unsigned char alpha;
+};
+
+// ITU-R BT.601 luma weights scaled to 256
+constexpr auto LUMA_RED = 77U;
+constexpr auto LUMA_GREEN = 150U;
+constexpr auto LUMA_BLUE = 29U;
+
+template <typename T> auto loadValue(const unsigned char* pixel) -> T {
+    auto value = T{};
+    std::memcpy(&value, pixel, sizeof(value));
+    return value;
+}
+
+template <typename T> auto storeValue(unsigned char* pixel, T value) -> void {
+    std::memcpy(pixel, &value, sizeof(value));
+}
+
+// 5/6/5 bits with red (RGB565) or blue (BGR565) in the top bits
+template <bool RedHigh> struct Packed565Format {
+    static constexpr auto bytesPerPixel = 2U;
+
+    static auto load(const unsigned char* pixel) -> Rgba {
+        auto value = loadValue<uint16_t>(pixel);
+        auto high = static_cast<unsigned>(value >> 11U);
+        auto low = static_cast<unsigned>(value & 0x1FU);
+        return Rgba{
+            RED_TABLE[RedHigh ? high : low],
+            GREEN_TABLE[(value >> 5U) & 0x3FU],
+            BLUE_TABLE[RedHigh ? low : high],
+            COLOR_MAX,
+        };
+    }
+
+    static auto store(unsigned char* pixel, Rgba color) -> void {
+        auto high = static_cast<unsigned>(RedHigh ? color.red : color.blue) >> 3U;
+        auto low = static_cast<unsigned>(RedHigh ? color.blue : color.red) >> 3U;
+        auto green = static_cast<unsigned>(color.green) >> 2U;
+        storeValue(pixel, static_cast<uint16_t>((high << 11U) | (green << 5U) | low));
+    }
+};
+
+using Rgb565Format = Packed565Format<true>;
+using Bgr565Format = Packed565Format<false>;
+
+// 32-bit value with blue in the lowest byte; the top byte is alpha or padding
+template <bool HasAlpha> struct Packed8888Format {
+    static constexpr auto bytesPerPixel = 4U;
+
+    static auto load(const unsigned char* pixel) -> Rgba {
+        auto value = loadValue<uint32_t>(pixel);
+        return Rgba{
+            static_cast<unsigned char>(value >> 16U),
+            static_cast<unsigned char>(value >> 8U),
+            static_cast<unsigned char>(value),
+            static_cast<unsigned char>(HasAlpha ? value >> 24U : COLOR_MAX),
+        };
+    }
+
+    static auto store(unsigned char* pixel, Rgba color) -> void {
+        auto alpha = HasAlpha ? uint32_t{color.alpha} : uint32_t{COLOR_MAX};
+        storeValue(
+            pixel,
+            (alpha << 24U) | (uint32_t{color.red} << 16U) |
+                (uint32_t{color.green} << 8U) | uint32_t{color.blue}
+        );
+    }
+};
+
+using Xrgb8888Format = Packed8888Format<false>;
+using Argb8888Format = Packed8888Format<true>;
+
+// Byte sequence red, green, blue (and alpha)
+template <bool HasAlpha> struct ByteRgbFormat {
+    static constexpr auto bytesPerPixel = HasAlpha ? 4U : 3U;
+
+    static auto load(const unsigned char* pixel) -> Rgba {
+        auto alpha = HasAlpha ? pixel[3] : static_cast<unsigned char>(COLOR_MAX);
+        return Rgba{pixel[0], pixel[1], pixel[2], alpha};
+    }
+
+    static auto store(unsigned char* pixel, Rgba color) -> void {
+        pixel[0] = color.red;
+        pixel[1] = color.green;
+        pixel[2] = color.blue;
+        if constexpr (HasAlpha) {
+            pixel[3] = color.alpha;
+        }
+    }
+};
+
+using Rgb888Format = ByteRgbFormat<false>;
+using Rgba8888Format = ByteRgbFormat<true>;
+
+struct Gray8Format {
+    static constexpr auto bytesPerPixel = 1U;
+
+    static auto load(const unsigned char* pixel) -> Rgba {
+        return Rgba{pixel[0], pixel[0], pixel[0], COLOR_MAX};
+    }
+
+    static auto store(unsigned char* pixel, Rgba color) -> void {
+        auto luma = LUMA_RED * color.red + LUMA_GREEN * color.green + LUMA_BLUE * color.blue;
+        pixel[0] = static_cast<unsigned char>((luma + 128U) >> 8U);
+    }
+};
+
+template <typename Src, typename Dst>
+auto convertRow(const unsigned char* src, unsigned char* dst, size_t count) -> void {
+    if constexpr (std::is_same_v<Src, Dst>) {
+        std::memcpy(dst, src, count * Src::bytesPerPixel);
+    } else if constexpr (std::is_same_v<Src, Rgb565Format> && std::is_same_v<Dst, Rgb888Format>) {
+        // the hot path of the TXT 4.0 display has its own SIMD kernels
+        convertRgb565ToRgb888(
+            reinterpret_cast<const RGB565*>(src), // NOLINT (reinterpret_cast)
+            reinterpret_cast<RGB888*>(dst),       // NOLINT (reinterpret_cast)
+            count
+        );
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            Dst::store(dst + i * Dst::bytesPerPixel, Src::load(src + i * Src::bytesPerPixel));
+        }
+    }
+}
+
+using RowConverter = void (*)(const unsigned char*, unsigned char*, size_t);
+
+// All formats, in the order of the PixelFormat enumerators
+template <typename... Formats> struct FormatList {
+    static constexpr auto count = sizeof...(Formats);
+
+    template <typename Src>
+    static constexpr auto convertersFrom() -> std::array<RowConverter, count> {
+        return {&convertRow<Src, Formats>...};
+    }
+
+    static constexpr auto converters() -> std::array<std::array<RowConverter, count>, count> {
+        return {convertersFrom<Formats>()...};
+    }
+
+    static constexpr auto bytesPerPixel() -> std::array<uint32_t, count> {
+        return {Formats::bytesPerPixel...};
+    }
+};
+
+using PixelFormats = FormatList<
+    Rgb565Format,
+    Bgr565Format,
+    Xrgb8888Format,
+    Argb8888Format,
+    Rgb888Format,
+    Rgba8888Format,
+    Gray8Format>;
+
+constexpr auto ROW_CONVERTERS = PixelFormats::converters();
+constexpr auto BYTES_PER_PIXEL = PixelFormats::bytesPerPixel();
+
+auto rowConverter(PixelFormat src, PixelFormat dst) -> RowConverter {
+    return ROW_CONVERTERS[static_cast<size_t>(src)][static_cast<size_t>(dst)];
+}
+
+auto bytesPerPixel(PixelFormat format) -> uint32_t {
+    return BYTES_PER_PIXEL[static_cast<size_t>(format)];
+}
+
+// The 8-bit RGB value of a single raw frame buffer pixel
+auto expandPixel(const FrameFormat& format, const unsigned char* pixel) -> RGB888 {
+    auto color = RGB888{};
+    auto* out = reinterpret_cast<unsigned char*>(&color); // NOLINT (reinterpret_cast)
+    if (auto src = format.pixelFormat()) {
+        rowConverter(*src, PixelFormat::Rgb888)(pixel, out, 1);
+    } else if (format.isByteAligned()) {
+        convertByteAlignedToRgb888(pixel, &color, 1, format);
+    } else {
+        convertGenericToRgb888(pixel, &color, 1, format);
+    }
+    return color;
+}
+
+/**
+ * Exact palette for frames with at most MAX_PALETTE_SIZE distinct colors.
+ *
+ * The census hashes the raw frame buffer values (padding and alpha bits masked off), skipping
+ * runs of identical pixels, and gives up as soon as the palette overflows. The palette is kept
+ * between frames: a frame whose colors are all known, or still fit next to the known ones, keeps
+ * the existing indices.
+ */
+class FramePalette {
+  public:
+    // Map every pixel of the frame to a palette entry; false if the frame has too many colors
+    auto build(const FrameView& frame) -> bool {
+        if (colorMask == 0 || not sameLayout(frame.format)) {
+            layout = frame.format;
+            colorMask = fieldMask(layout.red) | fieldMask(layout.green) | fieldMask(layout.blue);
+            clear();
+        }
+        if (census(frame)) {
+            return true;
+        }
+        clear();
+        return census(frame);
+    }
+
+    [[nodiscard]] auto colors() const -> const std::vector<RGB888>& { return entries; }
+
+    // Smallest PNG bit depth able to index every entry
+    [[nodiscard]] auto bitDepth() const -> int {
+        auto depth = 1;
+        while ((size_t{1} << static_cast<unsigned>(depth)) < entries.size()) {
+            depth *= 2;
+        }
+        return depth;
+    }
+
+    // Palette indices (one per byte) of row `y` of a frame this palette was built for
+    auto indexRow(const FrameView& frame, uint32_t y, unsigned char* out) const -> void {
+        const auto* pixel = frame.row(y);
+        auto bpp = layout.bytesPerPixel();
+        auto lastKey = ~uint32_t{0};
+        auto lastIndex = static_cast<unsigned char>(0);
+        for (auto x = 0U; x < layout.width; ++x, pixel += bpp) {
+            auto key = keyOf(pixel);
+            if (key != lastKey) {
+                lastKey = key;
+                lastIndex = static_cast<unsigned char>(slots[find(key)].index);
+            }
+            out[x] = lastIndex;
+        }
+    }
+
+  private:
+    // Open addressing with at most 25% load
+    static constexpr auto SLOT_COUNT = MAX_PALETTE_SIZE * 4;
+
+    struct Slot {
+        uint32_t key = 0;
+        int16_t index = -1;
+    };
+
+    static auto fieldMask(const fb_bitfield& field) -> uint32_t {
+        auto bits = field.length >= 32 ? ~uint32_t{0} : (1U << field.length) - 1U;
+        return bits << field.offset;
+    }
+
+    [[nodiscard]] auto sameLayout(const FrameFormat& format) const -> bool {
+        auto same = [](const fb_bitfield& lhs, const fb_bitfield& rhs) {
+            return lhs.offset == rhs.offset && lhs.length == rhs.length;
+        };
+        return format.width == layout.width && format.height == layout.height &&
+               format.bitsPerPixel == layout.bitsPerPixel && same(format.red, layout.red) &&
+               same(format.green, layout.green) && same(format.blue, layout.blue);
+    }
+
+    [[nodiscard]] auto keyOf(const unsigned char* pixel) const -> uint32_t {
+        auto value = uint32_t{0};
+        std::memcpy(&value, pixel, layout.bytesPerPixel());
+        return value & colorMask;
+    }
+
+    // Slot holding `key`, or the empty slot where it belongs
+    [[nodiscard]] auto find(uint32_t key) const -> size_t {
+        auto slot = static_cast<size_t>((key * 0x9E3779B1U) >> 22U) % SLOT_COUNT;
+        while (slots[slot].index >= 0 && slots[slot].key != key) {
+            slot = (slot + 1) % SLOT_COUNT;
+        }
+        return slot;
+    }
+
+    auto census(const FrameView& frame) -> bool {
+        auto bpp = layout.bytesPerPixel();
+        auto lastKey = ~uint32_t{0};
+        for (auto y = 0U; y < layout.height; ++y) {
+            const auto* pixel = frame.row(y);
+            for (auto x = 0U; x < layout.width; ++x, pixel += bpp) {
+                auto key = keyOf(pixel);
+                if (key == lastKey) {
+                    continue;
+                }
+                lastKey = key;
+
+                auto& slot = slots[find(key)];
+                if (slot.index >= 0) {
+                    continue;
+                }
+                if (entries.size() == MAX_PALETTE_SIZE) {
+                    return false;
+                }
+                slot.key = key;
+                slot.index = static_cast<int16_t>(entries.size());
+                entries.push_back(expandPixel(layout, pixel));
+            }
+        }
+        return true;
+    }
+
+    auto clear() -> void {
+        slots.fill(Slot{});
+        entries.clear();
+    }
+
+    FrameFormat layout;
+    uint32_t colorMask = 0;
+    std::array<Slot, SLOT_COUNT> slots{};
+    std::vector<RGB888> entries;
+};
+
+/**
+ * Rows of a frame converted to an output pixel format, produced one at a time.
+ *
+ * Each row is converted into the same small buffer right before the encoder consumes it, so the
+ * working set stays at one row no matter how large the frame is. Rows already in the output
+ * format are handed out straight from the frame.
+ */
+class FrameRows {
+  public:
+    // Start converting `frame`; the buffers are kept across frames
+    auto assign(const FrameView& frame, PixelFormat format) -> void {
+        source = frame;
+        fmt = format;
+        indexed = nullptr;
+        sourceFormat = frame.format.pixelFormat();
+        convert = rowConverter(sourceFormat.value_or(PixelFormat::Rgb888), format);
+        rowBuf.resize(static_cast<size_t>(frame.format.width) * bytesPerPixel(format));
+        rgbRow.resize(sourceFormat ? 0 : frame.format.width);
+    }
+
+    // Hand out palette indices, one per byte, instead of pixels
+    auto assign(const FrameView& frame, const FramePalette& palette) -> void {
+        assign(frame, PixelFormat::Rgb888);
+        indexed = &palette;
+    }
+
+    [[nodiscard]] auto width() const -> uint32_t { return source.format.width; }
+    [[nodiscard]] auto height() const -> uint32_t { return source.format.height; }
+    [[nodiscard]] auto format() const -> PixelFormat { return fmt; }
+    [[nodiscard]] auto palette() const -> const FramePalette* { return indexed; }
+
+    // Row `y` in the output format; valid until the next call
+    auto row(uint32_t y) -> const unsigned char* {
+        const auto& src = source.format;
+        if (indexed != nullptr) {
+            indexed->indexRow(source, y, rowBuf.data());
+            return rowBuf.data();
+        }
+        if (sourceFormat == fmt) {
+            return source.row(y);
+        }
+        if (sourceFormat) {
+            convert(source.row(y), rowBuf.data(), src.width);
+            return rowBuf.data();
+        }
+
+        if (src.isByteAligned()) {
+            convertByteAlignedToRgb888(source.row(y), rgbRow.data(), src.width, src);
+        } else {
+            convertGenericToRgb888(source.row(y), rgbRow.data(), src.width, src);
+        }
+        // NOLINTNEXTLINE (reinterpret_cast)
+        convert(reinterpret_cast<const unsigned char*>(rgbRow.data()), rowBuf.data(), src.width);
+        return rowBuf.data();
+    }
+
+  private:
+    FrameView source;
+    PixelFormat fmt = PixelFormat::Rgb888;
+    std::optional<PixelFormat> sourceFormat;
+    RowConverter convert = nullptr;
+    const FramePalette* indexed = nullptr;
+    std::vector<unsigned char> rowBuf;
+    std::vector<RGB888> rgbRow; // layouts without a specialized converter go through RGB888
+};
+
+// zlib strategies (zlib.h is not among the shipped headers)
+constexpr auto Z_STRATEGY_DEFAULT = 0;
+constexpr auto Z_STRATEGY_FILTERED = 1;
+constexpr auto Z_STRATEGY_HUFFMAN_ONLY = 2;
+constexpr auto Z_STRATEGY_RLE = 3;
+
+// Share of equal horizontal neighbours above which a frame counts as flat UI content, and
+// below which it counts as noise
+constexpr auto FLAT_RATIO = 0.9;
+constexpr auto NOISY_RATIO = 0.2;
+
+enum class Profile : uint8_t { Fastest, Balanced, Smallest, Auto };
+
+// Settings handed to libpng/zlib for one image
+struct Compression {
+    int level;
+    int strategy;
+    int filters;       // PNG_FILTER_* mask for truecolor and gray images
+    size_t bufferSize; // zlib output buffer
+};
+
+constexpr auto FASTEST = Compression{1, Z_STRATEGY_RLE, PNG_FILTER_NONE, 65536};
+// libpng's own defaults
+constexpr auto BALANCED = Compression{6, Z_STRATEGY_FILTERED, PNG_ALL_FILTERS, 8192};
+constexpr auto SMALLEST = Compression{9, Z_STRATEGY_FILTERED, PNG_ALL_FILTERS, 65536};
+
+// Share of pixels equal to their left neighbour, sampled on every fourth row
+auto flatness(const FrameView& frame) -> double {
+    const auto& format = frame.format;
+    auto bpp = format.bytesPerPixel();
+    auto equal = size_t{0};
+    auto total = size_t{0};
+    for (auto y = 0U; y < format.height; y += 4) {
+        const auto* row = frame.row(y);
+        for (auto x = 1U; x < format.width; ++x) {
+            equal += std::memcmp(row + x * bpp, row + (x - 1) * bpp, bpp) == 0 ? 1 : 0;
+        }
+        total += format.width - 1;
+    }
+    return total == 0 ? 1.0 : static_cast<double>(equal) / static_cast<double>(total);
+}
+
+/**
+ * Compression settings of a profile for the given frame.
+ *
+ * The auto profile looks at how flat the frame is: flat UI screens compress almost as well with
+ * Z_RLE on unfiltered rows as with the full matcher, at a fraction of the cost; noise gains
+ * nothing from string matching, so Huffman coding of Sub-filtered rows is enough; everything in
+ * between gets the balanced settings.
+ */
+auto compressionFor(Profile profile, const FrameView& frame) -> Compression {
+    switch (profile) {
+    case Profile::Fastest:
+        return FASTEST;
+    case Profile::Smallest:
+        return SMALLEST;
+    case Profile::Auto: {
+        auto ratio = flatness(frame);
+        if (ratio >= FLAT_RATIO) {
+            return FASTEST;
+        }
+        if (ratio < NOISY_RATIO) {
+            return Compression{1, Z_STRATEGY_HUFFMAN_ONLY, PNG_FILTER_SUB, 65536};
+        }
+        return BALANCED;
+    }
+    case Profile::Balanced:
+    default:
+        return BALANCED;
+    }
+}
+
+auto parseProfile(std::string_view name) -> std::optional<Profile> {
+    if (name == "fastest") {
+        return Profile::Fastest;
+    }
+    if (name == "balanced") {
+        return Profile::Balanced;
+    }
+    if (name == "smallest") {
+        return Profile::Smallest;
+    }
+    if (name == "auto") {
+        return Profile::Auto;
+    }
+    return std::nullopt;
+}
+
+// PNG color type storing pixels of the given format as they are, or -1 if there is none
+auto pngColorType(PixelFormat format) -> int {
+    switch (format) {
+    case PixelFormat::Rgb888:
+        return PNG_COLOR_TYPE_RGB;
+    case PixelFormat::Rgba8888:
+        return PNG_COLOR_TYPE_RGB_ALPHA;
+    case PixelFormat::Gray8:
+        return PNG_COLOR_TYPE_GRAY;
+    default:
+        return -1;
+    }
+}
+
+// Write all of `data`, retrying short and interrupted writes
+auto writeAll(int fd, const unsigned char* data, size_t size) -> bool {
+    while (size > 0) {
+        auto written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// NOLINTBEGIN: libpng is a C library requiring some "unsafe" constructs
+auto appendToBuffer(png_structp png, png_bytep data, size_t length) -> void {
+    auto* buffer = static_cast<std::vector<unsigned char>*>(png_get_io_ptr(png));
+    buffer->insert(buffer->end(), data, data + length);
+}
+
+auto flushNothing(png_structp /*png*/) -> void {}
+
+/**
+ * Encode `rows` as PNG into `buffer`.
+ *
+ * libpng's output goes straight into the buffer, which keeps its capacity from frame to frame,
+ * so the file can be written with a single write.
+ */
+auto encodePng(FrameRows& rows, const Compression& compression, std::vector<unsigned char>& buffer)
+    -> bool {
+    const auto* palette = rows.palette();
+    const auto colorType =
+        palette != nullptr ? PNG_COLOR_TYPE_PALETTE : pngColorType(rows.format());
+    if (colorType < 0) {
+        std::cerr << "Pixel format cannot be written as PNG\n";
+        return false;
+    }
+
+    auto* png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (png == nullptr) {
+        std::cerr << "Failed to create PNG write struct\n";
+        return false;
+    }
+
+    auto* info = png_create_info_struct(png);
+    if (info == nullptr) {
+        std::cerr << "Failed to create PNG info struct\n";
+        png_destroy_write_struct(&png, nullptr);
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        std::cerr << "Failed to set PNG jump buffer\n";
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    buffer.clear();
+    png_set_write_fn(png, &buffer, appendToBuffer, flushNothing);
+
+    png_set_compression_level(png, compression.level);
+    png_set_compression_buffer_size(png, compression.bufferSize);
+    if (palette != nullptr) {
+        // filters do not help indexed rows
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+        png_set_compression_strategy(
+            png,
+            compression.strategy == Z_STRATEGY_FILTERED ? Z_STRATEGY_DEFAULT : compression.strategy
+        );
+    } else {
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, compression.filters);
+        png_set_compression_strategy(png, compression.strategy);
+    }
+
+    png_set_IHDR(
+        png,
+        info,
+        rows.width(),
+        rows.height(),
+        palette != nullptr ? palette->bitDepth() : 8,
+        colorType,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+    );
+
+    auto plte = std::array<png_color, MAX_PALETTE_SIZE>();
+    if (palette != nullptr) {
+        const auto& colors = palette->colors();
+        for (size_t i = 0; i < colors.size(); ++i) {
+            plte[i] = png_color{colors[i].red, colors[i].green, colors[i].blue};
+        }
+        png_set_PLTE(png, info, plte.data(), static_cast<int>(colors.size()));
+    }
+
+    png_write_info(png, info);
+    if (palette != nullptr) {
+        png_set_packing(png); // rows hold one index per byte
+    }
+
+    for (auto y = 0U; y < rows.height(); ++y) {
+        png_write_row(png, rows.row(y));
+    }
+
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+// NOLINTEND
+
+// CRC-32 of PNG chunks, computed like zlib's crc32()
+constexpr auto makeCrcTable() -> std::array<uint32_t, 256> {
+    auto table = std::array<uint32_t, 256>();
+    for (auto n = 0U; n < table.size(); ++n) {
+        auto crc = n;
+        for (auto k = 0; k < 8; ++k) {
+            crc = (crc & 1U) != 0 ? 0xEDB88320U ^ (crc >> 1U) : crc >> 1U;
+        }
+        table[n] = crc;
+    }
+    return table;
+}
+
+constexpr auto CRC_TABLE = makeCrcTable();
+
+auto crc32(uint32_t crc, const unsigned char* data, size_t size) -> uint32_t {
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = CRC_TABLE[(crc ^ data[i]) & 0xFFU] ^ (crc >> 8U);
+    }
+    return ~crc;
+}
+
+// Adler-32 of the zlib stream, computed like zlib's adler32()
+constexpr auto ADLER_MOD = 65521U;
+constexpr auto ADLER_BLOCK = size_t{5552}; // bytes the sums can take before they could overflow
+
+auto adler32(uint32_t adler, const unsigned char* data, size_t size) -> uint32_t {
+    auto a = adler & 0xFFFFU;
+    auto b = adler >> 16U;
+    while (size > 0) {
+        auto n = std::min(size, ADLER_BLOCK);
+        size -= n;
+        for (; n > 0; --n) {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    return (b << 16U) | a;
+}
+
+// Adler-32 of two concatenated pieces from their own checksums, like zlib's adler32_combine()
+auto adler32Combine(uint32_t adler1, uint32_t adler2, size_t size2) -> uint32_t {
+    auto rem = static_cast<uint32_t>(size2 % ADLER_MOD);
+    auto sum1 = adler1 & 0xFFFFU;
+    auto sum2 = (rem * sum1) % ADLER_MOD;
+    sum1 += (adler2 & 0xFFFFU) + ADLER_MOD - 1;
+    sum2 += (adler1 >> 16U) + (adler2 >> 16U) + ADLER_MOD - rem;
+    if (sum1 >= ADLER_MOD) {
+        sum1 -= ADLER_MOD;
+    }
+    if (sum1 >= ADLER_MOD) {
+        sum1 -= ADLER_MOD;
+    }
+    if (sum2 >= 2 * ADLER_MOD) {
+        sum2 -= 2 * ADLER_MOD;
+    }
+    if (sum2 >= ADLER_MOD) {
+        sum2 -= ADLER_MOD;
+    }
+    return (sum2 << 16U) | sum1;
+}
+
+// Deflate limits (RFC 1951)
+constexpr auto MIN_MATCH = 3U;
+constexpr auto MAX_MATCH = 258U;
+constexpr auto WINDOW_SIZE = 32768U;
+constexpr auto MAX_STORED_BLOCK = size_t{65535};
+
+constexpr auto LENGTH_BASE = std::array<uint32_t, 29>{
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+constexpr auto LENGTH_EXTRA = std::array<uint32_t, 29>{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+constexpr auto DISTANCE_BASE = std::array<uint32_t, 30>{
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+constexpr auto DISTANCE_EXTRA = std::array<uint32_t, 30>{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Bits ready for the LSB-first deflate bit stream: a bit-reversed Huffman code and its extra bits
+struct Code {
+    uint32_t bits;
+    uint32_t length;
+};
+
+constexpr auto reverseBits(uint32_t value, uint32_t length) -> uint32_t {
+    auto reversed = 0U;
+    for (auto i = 0U; i < length; ++i) {
+        reversed = (reversed << 1U) | ((value >> i) & 1U);
+    }
+    return reversed;
+}
+
+// Fixed literal/length code (RFC 1951, 3.2.6)
+constexpr auto fixedLiteralCode(uint32_t symbol) -> Code {
+    if (symbol < 144) {
+        return {reverseBits(0x30 + symbol, 8), 8};
+    }
+    if (symbol < 256) {
+        return {reverseBits(0x190 + symbol - 144, 9), 9};
+    }
+    if (symbol < 280) {
+        return {reverseBits(symbol - 256, 7), 7};
+    }
+    return {reverseBits(0xC0 + symbol - 280, 8), 8};
+}
+
+constexpr auto makeLiteralTable() -> std::array<Code, 257> {
+    auto table = std::array<Code, 257>();
+    for (auto symbol = 0U; symbol < table.size(); ++symbol) {
+        table[symbol] = fixedLiteralCode(symbol);
+    }
+    return table;
+}
+
+// Code and extra bits of every match length
+constexpr auto makeLengthTable() -> std::array<Code, MAX_MATCH + 1> {
+    auto table = std::array<Code, MAX_MATCH + 1>();
+    auto index = 0U;
+    for (auto length = MIN_MATCH; length <= MAX_MATCH; ++length) {
+        while (index + 1 < LENGTH_BASE.size() && LENGTH_BASE[index + 1] <= length) {
+            ++index;
+        }
+        auto code = fixedLiteralCode(257 + index);
+        table[length] = {
+            code.bits | ((length - LENGTH_BASE[index]) << code.length),
+            code.length + LENGTH_EXTRA[index]
+        };
+    }
+    return table;
+}
+
+// Distance code of `distance - 1` below 256, and of `(distance - 1) >> 7` above, like zlib's
+constexpr auto makeDistanceTable() -> std::array<uint8_t, 512> {
+    auto table = std::array<uint8_t, 512>();
+    auto index = 0U;
+    for (auto distance = 1U; distance <= 256; ++distance) {
+        while (DISTANCE_BASE[index + 1] <= distance) {
+            ++index;
+        }
+        table[distance - 1] = static_cast<uint8_t>(index);
+    }
+    for (auto high = 2U; high < 256; ++high) {
+        while (index + 1 < DISTANCE_BASE.size() && DISTANCE_BASE[index + 1] <= (high << 7U) + 1) {
+            ++index;
+        }
+        table[256 + high] = static_cast<uint8_t>(index);
+    }
+    return table;
+}
+
+constexpr auto LITERAL_CODES = makeLiteralTable();
+constexpr auto LENGTH_CODES = makeLengthTable();
+constexpr auto DISTANCE_CODES = makeDistanceTable();
+constexpr auto END_OF_BLOCK = 256U;
+
+static_assert(LENGTH_CODES[MAX_MATCH].length == 8, "258 has its own code without extra bits");
+static_assert(DISTANCE_CODES[256 + ((WINDOW_SIZE - 1) >> 7U)] == 29, "window ends in last code");
+
+/**
+ * Deflate encoder specialized for screenshots.
+ *
+ * It only emits fixed Huffman codes, so there are no symbol statistics to gather or code tables
+ * to build, and looks for matches with a single probe of a hash table plus the previous byte.
+ * Filtered UI rows consist mostly of runs, which the previous byte catches, and repeated glyphs
+ * and widgets, which the hash probe catches. Data that does not shrink is stored instead.
+ *
+ * Streams that are not the last one end byte aligned after an empty stored block (a sync flush),
+ * so independently compressed pieces can simply be concatenated.
+ */
+class Deflater {
+  public:
+    // Append `data` as deflate blocks (without zlib framing) to `output`; `last` marks the end
+    // of the stream
+    auto compress(
+        const unsigned char* data,
+        size_t size,
+        bool last,
+        std::vector<unsigned char>& output
+    ) -> void {
+        auto start = output.size();
+        out = &output;
+        head.assign(HASH_SIZE, 0);
+
+        put(last ? 0b011U : 0b010U, 3); // block with fixed codes
+        size_t pos = 0;
+        while (pos + sizeof(uint32_t) <= size) {
+            auto& slot = head[hash(data + pos)];
+            auto candidate = slot;
+            slot = static_cast<uint32_t>(pos + 1);
+
+            auto limit = std::min(size - pos, size_t{MAX_MATCH});
+            auto length = size_t{0};
+            auto distance = size_t{1};
+            if (pos > 0) {
+                length = matchLength(data + pos, data + pos - 1, limit);
+            }
+            if (candidate != 0 && pos + 1 - candidate <= WINDOW_SIZE && length < limit) {
+                auto found = matchLength(data + pos, data + candidate - 1, limit);
+                if (found > length) {
+                    length = found;
+                    distance = pos + 1 - candidate;
+                }
+            }
+
+            if (length >= MIN_MATCH) {
+                putMatch(static_cast<uint32_t>(length), static_cast<uint32_t>(distance));
+                pos += length;
+            } else {
+                putLiteral(data[pos++]);
+            }
+        }
+        while (pos < size) {
+            putLiteral(data[pos++]);
+        }
+        put(LITERAL_CODES[END_OF_BLOCK].bits, LITERAL_CODES[END_OF_BLOCK].length);
+        if (not last) {
+            put(0b000U, 3);
+            flush();
+            output.insert(output.end(), {0x00, 0x00, 0xFF, 0xFF});
+        }
+        flush();
+
+        auto blocks = std::max(size_t{1}, (size + MAX_STORED_BLOCK - 1) / MAX_STORED_BLOCK);
+        auto storedSize = size + 5 * blocks;
+        if (output.size() - start > storedSize) {
+            output.resize(start);
+            store(data, size, last, output);
+        }
+    }
+
+  private:
+    static constexpr auto HASH_BITS = 15U;
+    static constexpr auto HASH_SIZE = size_t{1} << HASH_BITS;
+
+    static auto hash(const unsigned char* data) -> size_t {
+        auto value = uint32_t{0};
+        std::memcpy(&value, data, sizeof(value));
+        return (value * 0x9E3779B1U) >> (32U - HASH_BITS);
+    }
+
+    // Number of equal bytes at `a` and `b`, at most `limit`
+    static auto matchLength(const unsigned char* a, const unsigned char* b, size_t limit)
+        -> size_t {
+        auto length = size_t{0};
+        while (length + sizeof(uint64_t) <= limit) {
+            auto x = uint64_t{0};
+            auto y = uint64_t{0};
+            std::memcpy(&x, a + length, sizeof(x));
+            std::memcpy(&y, b + length, sizeof(y));
+            if (x != y) {
+                break;
+            }
+            length += sizeof(uint64_t);
+        }
+        while (length < limit && a[length] == b[length]) {
+            ++length;
+        }
+        return length;
+    }
+
+    // Stored blocks of at most MAX_STORED_BLOCK bytes
+    static auto store(
+        const unsigned char* data,
+        size_t size,
+        bool last,
+        std::vector<unsigned char>& output
+    ) -> void {
+        size_t pos = 0;
+        do {
+            auto n = std::min(size - pos, MAX_STORED_BLOCK);
+            output.push_back(last && pos + n == size ? 1 : 0);
+            for (auto value : {n, ~n}) {
+                output.push_back(static_cast<unsigned char>(value));
+                output.push_back(static_cast<unsigned char>(value >> 8U));
+            }
+            output.insert(output.end(), data + pos, data + pos + n);
+            pos += n;
+        } while (pos < size);
+    }
+
+    auto putLiteral(unsigned char value) -> void {
+        put(LITERAL_CODES[value].bits, LITERAL_CODES[value].length);
+    }
+
+    auto putMatch(uint32_t length, uint32_t distance) -> void {
+        const auto& lengthCode = LENGTH_CODES[length];
+        auto index = distance <= 256 ? DISTANCE_CODES[distance - 1]
+                                     : DISTANCE_CODES[256 + ((distance - 1) >> 7U)];
+        auto distanceBits =
+            reverseBits(index, 5) | ((distance - DISTANCE_BASE[index]) << 5U);
+        put(lengthCode.bits | (uint64_t{distanceBits} << lengthCode.length),
+            lengthCode.length + 5 + DISTANCE_EXTRA[index]);
+    }
+
+    // Append `length` (at most 32) bits, least significant first
+    auto put(uint64_t bits, uint32_t length) -> void {
+        bitBuf |= bits << bitCount;
+        bitCount += length;
+        if (bitCount >= 32) {
+            for (auto i = 0; i < 4; ++i) {
+                out->push_back(static_cast<unsigned char>(bitBuf));
+                bitBuf >>= 8U;
+            }
+            bitCount -= 32;
+        }
+    }
+
+    // Pad the last byte with zero bits
+    auto flush() -> void {
+        for (; bitCount > 0; bitCount = bitCount > 8 ? bitCount - 8 : 0) {
+            out->push_back(static_cast<unsigned char>(bitBuf));
+            bitBuf >>= 8U;
+        }
+        bitBuf = 0;
+    }
+
+    std::vector<unsigned char>* out = nullptr;
+    uint64_t bitBuf = 0;
+    uint32_t bitCount = 0;
+    std::vector<uint32_t> head; // position + 1 of the last occurrence of each hash, 0 if none
+};
+
+constexpr auto MAX_CODE_BITS = 15U;
+constexpr auto LITERAL_SYMBOLS = 288U;
+constexpr auto DISTANCE_SYMBOLS = 30U;
+
+/**
+ * Deflate decoder for everything the Deflater above and zlib write: stored, fixed and dynamic
+ * Huffman blocks.
+ *
+ * Codes are decoded one bit at a time from canonical counts, as in zlib's puff; recordings only
+ * decompress on extraction, where simplicity matters more than speed.
+ */
+class Inflater {
+  public:
+    // Decode `data` into exactly `outSize` bytes at `out`; false if the stream is corrupt
+    auto inflate(const unsigned char* data, size_t size, unsigned char* out, size_t outSize)
+        -> bool {
+        in = data;
+        inSize = size;
+        inPos = 0;
+        bitBuf = 0;
+        bitCount = 0;
+        overrun = false;
+        output = out;
+        outCapacity = outSize;
+        outPos = 0;
+
+        auto last = false;
+        while (not last) {
+            last = bits(1) != 0;
+            auto type = bits(2);
+            auto ok = false;
+            if (type == 0) {
+                ok = stored();
+            } else if (type == 1) {
+                ok = fixed();
+            } else if (type == 2) {
+                ok = dynamic();
+            }
+            if (not ok || overrun) {
+                return false;
+            }
+        }
+        return outPos == outCapacity;
+    }
+
+  private:
+    // Canonical Huffman code: number of codes per length and the symbols ordered by code
+    struct Huffman {
+        std::array<uint16_t, MAX_CODE_BITS + 1> count;
+        std::array<uint16_t, LITERAL_SYMBOLS> symbol;
+    };
+
+    // Build `code` from the code length of each symbol; false if it is over-subscribed, or
+    // incomplete while `complete` is required
+    static auto build(Huffman& code, const uint8_t* lengths, size_t symbols, bool complete)
+        -> bool {
+        code.count.fill(0);
+        for (size_t i = 0; i < symbols; ++i) {
+            ++code.count[lengths[i]];
+        }
+        if (code.count[0] == symbols) {
+            return not complete;
+        }
+
+        auto left = 1;
+        for (auto length = 1U; length <= MAX_CODE_BITS; ++length) {
+            left = 2 * left - code.count[length];
+            if (left < 0) {
+                return false;
+            }
+        }
+
+        auto offsets = std::array<uint16_t, MAX_CODE_BITS + 2>();
+        for (auto length = 1U; length <= MAX_CODE_BITS; ++length) {
+            offsets[length + 1] = static_cast<uint16_t>(offsets[length] + code.count[length]);
+        }
+        for (size_t i = 0; i < symbols; ++i) {
+            if (lengths[i] != 0) {
+                code.symbol[offsets[lengths[i]]++] = static_cast<uint16_t>(i);
+            }
+        }
+        return left == 0 || not complete;
+    }
+
+    auto bits(uint32_t count) -> uint32_t {
+        while (bitCount < count) {
+            if (inPos == inSize) {
+                overrun = true;
+                return 0;
+            }
+            bitBuf |= uint32_t{in[inPos++]} << bitCount;
+            bitCount += 8;
+        }
+        auto value = bitBuf & ((1U << count) - 1);
+        bitBuf >>= count;
+        bitCount -= count;
+        return value;
+    }
+
+    // Next symbol of `code`, or -1 for an invalid code
+    auto decode(const Huffman& code) -> int {
+        auto value = 0;
+        auto first = 0;
+        auto index = 0;
+        for (auto length = 1U; length <= MAX_CODE_BITS && not overrun; ++length) {
+            value |= static_cast<int>(bits(1));
+            auto count = static_cast<int>(code.count[length]);
+            if (value - count < first) {
+                return code.symbol[static_cast<size_t>(index + value - first)];
+            }
+            index += count;
+            first = (first + count) << 1;
+            value <<= 1;
+        }
+        return -1;
+    }
+
+    auto stored() -> bool {
+        bitBuf = 0;
+        bitCount = 0;
+        if (inPos + 4 > inSize) {
+            return false;
+        }
+        auto length = size_t{in[inPos]} | size_t{in[inPos + 1]} << 8U;
+        auto check = size_t{in[inPos + 2]} | size_t{in[inPos + 3]} << 8U;
+        inPos += 4;
+        if (length != (~check & 0xFFFFU) || inPos + length > inSize ||
+            outPos + length > outCapacity) {
+            return false;
+        }
+        std::memcpy(output + outPos, in + inPos, length);
+        inPos += length;
+        outPos += length;
+        return true;
+    }
+
+    auto fixed() -> bool {
+        static const auto codes = [] {
+            auto lengths = std::array<uint8_t, LITERAL_SYMBOLS + DISTANCE_SYMBOLS>();
+            for (auto i = 0U; i < LITERAL_SYMBOLS; ++i) {
+                lengths[i] = static_cast<uint8_t>(fixedLiteralCode(i).length);
+            }
+            std::fill(lengths.begin() + LITERAL_SYMBOLS, lengths.end(), 5);
+            auto tables = std::array<Huffman, 2>();
+            build(tables[0], lengths.data(), LITERAL_SYMBOLS, false);
+            build(tables[1], lengths.data() + LITERAL_SYMBOLS, DISTANCE_SYMBOLS, false);
+            return tables;
+        }();
+        return inflateCodes(codes[0], codes[1]);
+    }
+
+    auto dynamic() -> bool {
+        constexpr auto ORDER = std::array<uint8_t, 19>{
+            16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+        };
+
+        auto literals = bits(5) + 257;
+        auto distances = bits(5) + 1;
+        auto lengthCodes = bits(4) + 4;
+        if (literals > 286 || distances > DISTANCE_SYMBOLS) {
+            return false;
+        }
+
+        auto lengths = std::array<uint8_t, LITERAL_SYMBOLS + DISTANCE_SYMBOLS>();
+        for (auto i = 0U; i < lengthCodes; ++i) {
+            lengths[ORDER[i]] = static_cast<uint8_t>(bits(3));
+        }
+        if (not build(lengthCode, lengths.data(), ORDER.size(), true)) {
+            return false;
+        }
+
+        auto total = literals + distances;
+        for (auto i = 0U; i < total;) {
+            auto symbol = decode(lengthCode);
+            if (symbol < 0) {
+                return false;
+            }
+            if (symbol < 16) {
+                lengths[i++] = static_cast<uint8_t>(symbol);
+                continue;
+            }
+            auto repeat = uint8_t{0};
+            auto times = 0U;
+            if (symbol == 16) {
+                if (i == 0) {
+                    return false;
+                }
+                repeat = lengths[i - 1];
+                times = 3 + bits(2);
+            } else if (symbol == 17) {
+                times = 3 + bits(3);
+            } else {
+                times = 11 + bits(7);
+            }
+            if (i + times > total) {
+                return false;
+            }
+            for (; times > 0; --times) {
+                lengths[i++] = repeat;
+            }
+        }
+        if (lengths[END_OF_BLOCK] == 0) {
+            return false;
+        }
+
+        return build(literalCode, lengths.data(), literals, false) &&
+               build(distanceCode, lengths.data() + literals, distances, false) &&
+               inflateCodes(literalCode, distanceCode);
+    }
+
+    // Literals and matches up to the end of the block
+    auto inflateCodes(const Huffman& literal, const Huffman& distance) -> bool {
+        while (true) {
+            auto symbol = decode(literal);
+            if (symbol < 0) {
+                return false;
+            }
+            if (symbol < static_cast<int>(END_OF_BLOCK)) {
+                if (outPos == outCapacity) {
+                    return false;
+                }
+                output[outPos++] = static_cast<unsigned char>(symbol);
+                continue;
+            }
+            if (symbol == static_cast<int>(END_OF_BLOCK)) {
+                return true;
+            }
+
+            auto index = static_cast<size_t>(symbol) - END_OF_BLOCK - 1;
+            if (index >= LENGTH_BASE.size()) {
+                return false;
+            }
+            auto length = LENGTH_BASE[index] + bits(LENGTH_EXTRA[index]);
+            auto code = decode(distance);
+            if (code < 0 || static_cast<size_t>(code) >= DISTANCE_BASE.size()) {
+                return false;
+            }
+            auto back = DISTANCE_BASE[static_cast<size_t>(code)] +
+                        bits(DISTANCE_EXTRA[static_cast<size_t>(code)]);
+            if (overrun || back > outPos || outPos + length > outCapacity) {
+                return false;
+            }
+            for (; length > 0; --length, ++outPos) {
+                output[outPos] = output[outPos - back];
+            }
+        }
+    }
+
+    const unsigned char* in = nullptr;
+    size_t inSize = 0;
+    size_t inPos = 0;
+    uint32_t bitBuf = 0;
+    uint32_t bitCount = 0;
+    bool overrun = false;
+    unsigned char* output = nullptr;
+    size_t outCapacity = 0;
+    size_t outPos = 0;
+    Huffman lengthCode{};
+    Huffman literalCode{};
+    Huffman distanceCode{};
+};
+
+// What a file name template can refer to
+struct NameFields {
+    time_t timestamp = 0;
+    uint64_t frame = 0; // index of the capture in the session
+    Rect dirty;
+    const unsigned char* data = nullptr; // the encoded file, for {hash}
+    size_t size = 0;
+};
+
+// Longest path a file name template may render to
+constexpr auto MAX_PATH_SIZE = size_t{4096};
+
+// Hex digits of {hash}: the whole CRC-32
+constexpr auto HASH_DIGITS = 8U;
+
+/**
+ * A file name template such as "shots/%Y%m%d/{seq:06}-{hash8}.png".
+ *
+ * Text outside braces is a strftime format. The fields are:
+ *   {seq}     number of files named so far, starting at 0
+ *   {frame}   index of the capture in the session
+ *   {width}, {height}, {x}, {y}  the changed area of the frame
+ *   {hash}    CRC-32 of the encoded file in hex; {hash1} to {hash8} keep that many digits
+ * ":<n>" after a numeric field zero-pads it to n digits, e.g. {seq:06}.
+ *
+ * The template is parsed once into tokens. Rendering writes into the caller's buffer without
+ * allocating, and strftime only runs when the second changes.
+ */
+class NameTemplate {
+  public:
+    // nullopt for unbalanced braces, unknown fields or an empty template
+    static auto parse(std::string_view text) -> std::optional<NameTemplate> {
+        auto result = NameTemplate();
+        auto pos = size_t{0};
+        while (pos < text.size()) {
+            auto open = text.find('{', pos);
+            auto literal = text.substr(pos, open == std::string_view::npos ? open : open - pos);
+            if (literal.find('}') != std::string_view::npos) {
+                return std::nullopt;
+            }
+            if (not literal.empty()) {
+                auto token = Token{Field::Text, result.formats.size(), literal.size(), 0};
+                result.formats.append(literal);
+                result.formats.push_back('\0');
+                result.tokens.push_back(token);
+            }
+            if (open == std::string_view::npos) {
+                break;
+            }
+            auto close = text.find('}', open);
+            if (close == std::string_view::npos) {
+                return std::nullopt;
+            }
+            auto token = parseField(text.substr(open + 1, close - open - 1));
+            if (not token) {
+                return std::nullopt;
+            }
+            result.tokens.push_back(*token);
+            pos = close + 1;
+        }
+        if (result.tokens.empty()) {
+            return std::nullopt;
+        }
+        return result;
+    }
+
+    // Render into `out`, NUL terminated; returns the length, or 0 if it does not fit
+    auto render(const NameFields& fields, uint64_t sequence, char* out, size_t capacity)
+        -> size_t {
+        if (not renderedValid || fields.timestamp != renderedSecond) {
+            renderTimes(fields.timestamp);
+        }
+
+        auto length = size_t{0};
+        auto append = [&](const char* text, size_t size) {
+            if (length + size >= capacity) {
+                return false;
+            }
+            std::memcpy(out + length, text, size);
+            length += size;
+            return true;
+        };
+
+        for (const auto& token : tokens) {
+            auto ok = true;
+            switch (token.field) {
+            case Field::Text:
+                ok = append(rendered.data() + token.rendered, token.renderedSize);
+                break;
+            case Field::Hash: {
+                auto digits = std::array<char, HASH_DIGITS>();
+                auto crc = crc32(0, fields.data, fields.size);
+                for (auto i = 0U; i < HASH_DIGITS; ++i) {
+                    digits[i] = "0123456789abcdef"[(crc >> (28 - 4 * i)) & 0xFU];
+                }
+                ok = append(digits.data(), token.width);
+                break;
+            }
+            default: {
+                auto digits = std::array<char, COUNTER_STR_SIZE * 2>(); // any uint64_t
+                auto number = value(token.field, fields, sequence);
+                auto* end = std::to_chars(digits.data(), digits.data() + digits.size(), number).ptr;
+                auto size = static_cast<size_t>(end - digits.data());
+                for (auto pad = size; ok && pad < token.width; ++pad) {
+                    ok = append("0", 1);
+                }
+                ok = ok && append(digits.data(), size);
+                break;
+            }
+            }
+            if (not ok) {
+                return 0;
+            }
+        }
+        out[length] = '\0';
+        return length;
+    }
+
+  private:
+    enum class Field : uint8_t { Text, Sequence, Frame, Width, Height, X, Y, Hash };
+
+    struct Token {
+        Field field;
+        size_t format;     // Text: offset of the strftime format in `formats`
+        size_t formatSize; // Text: its length
+        size_t width;      // minimum digits, or hex digits of a hash
+        size_t rendered = 0;
+        size_t renderedSize = 0;
+    };
+
+    static auto parseField(std::string_view spec) -> std::optional<Token> {
+        auto colon = spec.find(':');
+        auto name = spec.substr(0, colon);
+        auto width = size_t{0};
+        if (colon != std::string_view::npos) {
+            auto digits = spec.substr(colon + 1);
+            const auto* last = digits.data() + digits.size();
+            auto [end, ec] = std::from_chars(digits.data(), last, width);
+            if (digits.empty() || ec != std::errc() || end != last ||
+                width > COUNTER_STR_SIZE * 2) {
+                return std::nullopt;
+            }
+        }
+
+        static constexpr auto NUMERIC = std::array<std::pair<std::string_view, Field>, 6>{{
+            {"seq", Field::Sequence},
+            {"frame", Field::Frame},
+            {"width", Field::Width},
+            {"height", Field::Height},
+            {"x", Field::X},
+            {"y", Field::Y},
+        }};
+        for (const auto& [fieldName, field] : NUMERIC) {
+            if (name == fieldName) {
+                return Token{field, 0, 0, width};
+            }
+        }
+
+        if (name.substr(0, 4) != "hash" || colon != std::string_view::npos) {
+            return std::nullopt;
+        }
+        auto digits = name.size() == 4 ? HASH_DIGITS : 0U;
+        if (name.size() == 5 && name[4] >= '1') {
+            digits = static_cast<unsigned>(name[4] - '0');
+        }
+        if (digits == 0 || digits > HASH_DIGITS) {
+            return std::nullopt;
+        }
+        return Token{Field::Hash, 0, 0, digits};
+    }
+
+    static auto value(Field field, const NameFields& fields, uint64_t sequence) -> uint64_t {
+        switch (field) {
+        case Field::Sequence:
+            return sequence;
+        case Field::Frame:
+            return fields.frame;
+        case Field::Width:
+            return fields.dirty.width;
+        case Field::Height:
+            return fields.dirty.height;
+        case Field::X:
+            return fields.dirty.x;
+        case Field::Y:
+        default:
+            return fields.dirty.y;
+        }
+    }
+
+    // Run the strftime formats for a new second
+    auto renderTimes(time_t timestamp) -> void {
+        auto local = tm{};
+        (void)localtime_r(&timestamp, &local);
+        auto used = size_t{0};
+        for (auto& token : tokens) {
+            if (token.field != Field::Text) {
+                continue;
+            }
+            token.rendered = used;
+            // 0 for an empty result or one that does not fit; either way nothing is appended
+            token.renderedSize = strftime(
+                rendered.data() + used, rendered.size() - used, &formats[token.format], &local
+            );
+            used += token.renderedSize;
+        }
+        renderedSecond = timestamp;
+        renderedValid = true;
+    }
+
+    std::string formats; // strftime formats of the text tokens, each NUL terminated
+    std::vector<Token> tokens;
+    std::array<char, MAX_PATH_SIZE> rendered{}; // text tokens for `renderedSecond`
+    time_t renderedSecond = 0;
+    bool renderedValid = false;
+};
+
+/**
+ * Hands out unique file names in one directory: <base>[-<date>][-<n>]<extension>, or the
+ * rendering of a name template.
+ *
+ * The directory is scanned once, on the first name, for the highest counter of every existing
+ * name; after that naming costs no system call. A name repeating the previous one gets the next
+ * counter, so names are unique within the session. Other processes are only noticed when a file
+ * is published, which never replaces an existing one (see publish()). Template names are checked
+ * with stat() whenever the rendered name changes instead, and the directories they name are
+ * created as needed.
+ */
+class FileNamer {
+  public:
+    FileNamer(
+        std::string_view directory,
+        std::string_view baseName,
+        std::string_view extension,
+        bool includeDate,
+        std::optional<NameTemplate> nameTemplate = std::nullopt
+    )
+        : directory(directory), baseName(baseName), extension(extension),
+          includeDate(includeDate), nameTemplate(std::move(nameTemplate)) {}
+
+    // The path for the next capture
+    auto claim(const NameFields& fields) -> std::optional<std::string> {
+        if (nameTemplate) {
+            if (not renderTemplate(fields)) {
+                return std::nullopt;
+            }
+        } else if (lastStem.empty() || (includeDate && fields.timestamp != lastTime)) {
+            if (not scanned) {
+                scan();
+            }
+            lastName = baseName;
+            if (includeDate) {
+                lastName.append("-");
+                lastName.append(getDate(fields.timestamp).data());
+            }
+            auto stem = directory.empty() ? lastName : directory + "/" + lastName;
+            if (stem != lastStem) {
+                auto existing = taken.find(lastName);
+                lastCounter = existing == taken.end() ? 0 : existing->second;
+                lastStem = std::move(stem);
+            }
+            lastTime = fields.timestamp;
+        }
+
+        return pathFor(lastCounter++);
+    }
+
+  private:
+    // <last stem>[-<counter>]<extension>, without a counter while it is 0
+    [[nodiscard]] auto pathFor(uint64_t counter) const -> std::string {
+        auto path = lastStem;
+        if (counter != 0) {
+            auto counterStr = std::array<char, COUNTER_STR_SIZE * 2>();
+            auto [endPtr, ec] = std::to_chars(counterStr.begin(), counterStr.end(), counter);
+            if (ec != std::errc()) {
+                throw std::runtime_error("Failed to convert number to string");
+            }
+            path.append("-");
+            path.append(counterStr.begin(), endPtr);
+        }
+        path.append(extension);
+        return path;
+    }
+
+    // Render the template into the stem of the next name
+    auto renderTemplate(const NameFields& fields) -> bool {
+        auto path = std::array<char, MAX_PATH_SIZE>();
+        auto length = size_t{0};
+        if (not directory.empty()) {
+            length = std::min(directory.size(), path.size() - 2);
+            std::memcpy(path.data(), directory.data(), length);
+            path[length++] = '/';
+        }
+        auto rendered =
+            nameTemplate->render(fields, sequence, path.data() + length, path.size() - length);
+        if (rendered == 0) {
+            std::cerr << "File name template renders to an empty or too long path\n";
+            return false;
+        }
+        length += rendered;
+        ++sequence;
+
+        auto stem = std::string_view(path.data(), length);
+        if (stem.size() > extension.size() &&
+            stem.substr(stem.size() - extension.size()) == extension) {
+            stem.remove_suffix(extension.size());
+        }
+        if (auto slash = stem.rfind('/'); slash != std::string_view::npos && slash != 0) {
+            if (not makeDirectories(stem.substr(0, slash))) {
+                return false;
+            }
+        }
+        if (stem != lastStem) {
+            // a new stem: step over files of earlier sessions, which were not scanned for
+            lastStem.assign(stem);
+            lastCounter = 0;
+            struct stat info {};
+            while (stat(pathFor(lastCounter).c_str(), &info) == 0) {
+                ++lastCounter;
+            }
+        }
+        return true;
+    }
+
+    // mkdir -p, skipped while the directory is the one of the previous name
+    auto makeDirectories(std::string_view path) -> bool {
+        if (path == lastDirectory) {
+            return true;
+        }
+        auto partial = std::string(path);
+        for (auto slash = partial.find('/', 1);; slash = partial.find('/', slash + 1)) {
+            if (slash != std::string::npos) {
+                partial[slash] = '\0';
+            }
+            if (mkdir(partial.c_str(), 0755) != 0 && errno != EEXIST) {
+                std::cerr << "Failed to create directory " << partial.c_str() << ": "
+                          << std::strerror(errno) << "\n";
+                return false;
+            }
+            if (slash == std::string::npos) {
+                break;
+            }
+            partial[slash] = '/';
+        }
+        lastDirectory = path;
+        return true;
+    }
+
+    /**
+     * Record the next free counter of every stem found in the directory.
+     *
+     * A trailing "-<digits>" may be a counter or part of the date, so both readings are kept: the
+     * whole stem is taken (next counter 1) and its prefix continues after that number. The wrong
+     * reading only adds an entry no real stem asks for. Temporary files left behind by a session
+     * that crashed or lost power are removed on the way.
+     */
+    auto scan() -> void {
+        scanned = true;
+        auto* dir = opendir(directory.empty() ? "." : directory.c_str());
+        if (dir == nullptr) {
+            return; // reported when the file cannot be created
+        }
+        while (const auto* entry = readdir(dir)) {
+            auto name = std::string_view(entry->d_name);
+            if (name.front() == '.') {
+                sweep(name);
+                continue;
+            }
+            if (name.size() <= baseName.size() + extension.size() ||
+                name.substr(0, baseName.size()) != baseName ||
+                name.substr(name.size() - extension.size()) != extension) {
+                continue;
+            }
+            auto stem = name.substr(0, name.size() - extension.size());
+            note(stem, 1);
+
+            auto dash = stem.rfind('-');
+            if (dash == std::string_view::npos || dash < baseName.size()) {
+                continue;
+            }
+            auto digits = stem.substr(dash + 1);
+            auto number = uint64_t{0};
+            const auto* last = digits.data() + digits.size();
+            auto [end, ec] = std::from_chars(digits.data(), last, number);
+            if (ec == std::errc() && end == last && not digits.empty()) {
+                note(stem.substr(0, dash), number + 1);
+            }
+        }
+        closedir(dir);
+    }
+
+    // Remove a temporary file (.<name>.<pid>.tmp, see temporaryPath()) whose writer is gone
+    auto sweep(std::string_view name) -> void {
+        constexpr auto suffix = std::string_view(".tmp");
+        if (name.size() <= suffix.size() + 1 ||
+            name.substr(name.size() - suffix.size()) != suffix) {
+            return;
+        }
+        auto inner = name.substr(1, name.size() - 1 - suffix.size());
+        auto dot = inner.rfind('.');
+        if (dot == std::string_view::npos) {
+            return;
+        }
+        auto target = inner.substr(0, dot);
+        auto digits = inner.substr(dot + 1);
+        auto pid = pid_t{0};
+        const auto* last = digits.data() + digits.size();
+        auto [end, ec] = std::from_chars(digits.data(), last, pid);
+        if (ec != std::errc() || end != last || pid <= 0 ||
+            target.size() <= baseName.size() + extension.size() ||
+            target.substr(0, baseName.size()) != baseName ||
+            target.substr(target.size() - extension.size()) != extension) {
+            return;
+        }
+        if (kill(pid, 0) == 0 || errno != ESRCH) {
+            return; // still being written, maybe by another session
+        }
+        auto path = directory.empty() ? std::string(name) : directory + "/" + std::string(name);
+        (void)unlink(path.c_str());
+    }
+
+    auto note(std::string_view stem, uint64_t next) -> void {
+        auto& counter = taken[std::string(stem)];
+        counter = std::max(counter, next);
+    }
+
+    std::string directory;
+    std::string baseName;
+    std::string extension;
+    bool includeDate;
+    std::optional<NameTemplate> nameTemplate;
+    bool scanned = false;
+    std::unordered_map<std::string, uint64_t> taken; // stem -> next counter, from the scan
+    time_t lastTime = 0;                             // of the last name handed out
+    std::string lastName;
+    std::string lastStem;
+    uint64_t lastCounter = 0;  // next one for `lastStem`, 0 for none
+    std::string lastDirectory; // created for the last template name
+    uint64_t sequence = 0;     // template names handed out
+};
+
+enum class FileFormat : uint8_t { Png, Ppm, Bmp, Raw565, Qoi };
+
+auto fileExtension(FileFormat format) -> std::string_view {
+    switch (format) {
+    case FileFormat::Ppm:
+        return ".ppm";
+    case FileFormat::Bmp:
+        return ".bmp";
+    case FileFormat::Raw565:
+        return ".raw";
+    case FileFormat::Qoi:
+        return ".qoi";
+    case FileFormat::Png:
+    default:
+        return ".png";
+    }
+}
+
+// How durable a saved file is
+enum class SyncMode : uint8_t {
+    None, // after a power cut a file may be missing or empty, but never partially written
+    Data, // its contents reach storage before it gets its name
+    Full, // and so does its directory entry
+};
+
+// Owns a file descriptor and closes it on destruction
+class UniqueFd {
+  public:
+    UniqueFd() = default;
+    explicit UniqueFd(int fd) : fd(fd) {}
+    UniqueFd(const UniqueFd&) = delete;
+    auto operator=(const UniqueFd&) -> UniqueFd& = delete;
+    UniqueFd(UniqueFd&& other) noexcept : fd(std::exchange(other.fd, -1)) {}
+    auto operator=(UniqueFd&& other) noexcept -> UniqueFd& {
+        if (this != &other) {
+            reset(std::exchange(other.fd, -1));
+        }
+        return *this;
+    }
+    ~UniqueFd() { reset(); }
+
+    auto reset(int newFd = -1) -> void {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        fd = newFd;
+    }
+
+    [[nodiscard]] auto get() const -> int { return fd; }
+    [[nodiscard]] auto valid() const -> bool { return fd >= 0; }
+
+  private:
+    int fd = -1;
+};
+
+// Hidden name a file is written under until it is complete, next to its final name
+auto temporaryPath(std::string_view path) -> std::string {
+    auto slash = path.rfind('/');
+    auto split = slash == std::string_view::npos ? 0 : slash + 1;
+    auto temp = std::string(path.substr(0, split));
+    temp.append(".");
+    temp.append(path.substr(split));
+    temp.append(".");
+    temp.append(std::to_string(getpid()));
+    temp.append(".tmp");
+    return temp;
+}
+
+// `path` with "-<counter>" before its extension
+auto numberedPath(std::string_view path, uint64_t counter) -> std::string {
+    auto slash = path.rfind('/');
+    auto nameStart = slash == std::string_view::npos ? 0 : slash + 1;
+    auto dot = path.rfind('.');
+    if (dot == std::string_view::npos || dot <= nameStart) {
+        dot = path.size();
+    }
+    auto numbered = std::string(path.substr(0, dot));
+    numbered.append("-");
+    numbered.append(std::to_string(counter));
+    numbered.append(path.substr(dot));
+    return numbered;
+}
+
+// Directory holding a path
+auto directoryOf(std::string_view path) -> std::string {
+    auto slash = path.rfind('/');
+    if (slash == std::string_view::npos) {
+        return ".";
+    }
+    return std::string(path.substr(0, std::max(slash, size_t{1})));
+}
+
+// Flush a written file to storage as far as the mode asks
+auto syncFile(int fd, SyncMode mode) -> bool {
+    switch (mode) {
+    case SyncMode::Data:
+        return fdatasync(fd) == 0;
+    case SyncMode::Full:
+        return fsync(fd) == 0;
+    case SyncMode::None:
+    default:
+        return true;
+    }
+}
+
+// The directory holding `path`, opened for syncing it
+auto openDirectory(const std::string& path) -> UniqueFd {
+    return UniqueFd(open(directoryOf(path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+}
+
+// Make the names created in a directory durable
+auto syncDirectory(const std::string& directory) -> bool {
+    auto fd = UniqueFd(open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    return fd.valid() && fsync(fd.get()) == 0;
+}
+
+// Close a file that failed to be written and remove it
+auto discardTemporary(int tempFd, const std::string& path) -> void {
+    auto error = errno;
+    close(tempFd);
+    (void)unlink(temporaryPath(path).c_str());
+    errno = error;
+}
+
+/**
+ * Complete a file written through `tempFd` under temporaryPath(path) and give it its name.
+ *
+ * The file is synced as the mode asks, closed and renamed in a single step, so it never shows up
+ * partially written. An exclusive (generated) name never replaces a file: when another process
+ * took it since it was picked, the file gets the next counter instead. With full durability
+ * `dirFd`, the directory of `path`, is synced after the rename; -1 leaves that to the caller,
+ * which batches them.
+ *
+ * Returns the name the file got, or nullopt with errno set and the temporary file removed. A
+ * directory that fails to sync does not undo the rename: the name is still returned, the failure
+ * is reported and `durable` cleared.
+ */
+auto publish(
+    int tempFd, int dirFd, const std::string& path, SyncMode sync, bool exclusive, bool& durable
+) -> std::optional<std::string> {
+    if (not syncFile(tempFd, sync)) {
+        discardTemporary(tempFd, path);
+        return std::nullopt;
+    }
+    if (close(tempFd) != 0) {
+        discardTemporary(-1, path);
+        return std::nullopt;
+    }
+
+    auto temp = temporaryPath(path);
+    auto name = path;
+    auto flags = exclusive ? unsigned{RENAME_NOREPLACE} : 0U;
+    for (auto counter = uint64_t{1};
+         renameat2(AT_FDCWD, temp.c_str(), AT_FDCWD, name.c_str(), flags) != 0;) {
+        if (flags != 0 && errno == EEXIST) {
+            name = numberedPath(path, counter++);
+        } else if (flags != 0 && (errno == EINVAL || errno == ENOSYS)) {
+            flags = 0; // not supported by the file system; names are unique within the session
+        } else {
+            discardTemporary(-1, path);
+            return std::nullopt;
+        }
+    }
+
+    if (sync == SyncMode::Full && dirFd >= 0 && fsync(dirFd) != 0) {
+        std::cerr << "Failed to sync the directory of " << name << ": " << std::strerror(errno)
+                  << "\n";
+        durable = false;
+    }
+    return name;
+}
+
+// Close a file written with stdio and publish it; false if any write, a sync or the close failed,
+// with `output` naming the file if it was published nonetheless
+auto closeFile(FILE* fp, bool written, Output& output, SyncMode sync) -> bool {
+    auto ok = fflush(fp) == 0 && written;
+    if (output.fd >= 0) {
+        ok = fclose(fp) == 0 && ok;
+        if (not ok) {
+            std::cerr << "Failed to write " << output.name() << "\n";
+        }
+        return ok;
+    }
+
+    // fclose() takes the stream's descriptor along, so publish() gets one of its own
+    auto fd = ok ? dup(fileno(fp)) : -1;
+    ok = fclose(fp) == 0 && fd >= 0;
+    auto dir = sync == SyncMode::Full ? openDirectory(output.path) : UniqueFd();
+    auto name = std::optional<std::string>();
+    auto durable = true;
+    if (ok) {
+        name = publish(fd, dir.get(), output.path, sync, output.exclusive, durable);
+    } else {
+        discardTemporary(fd, output.path);
+    }
+    if (not name) {
+        std::cerr << "Failed to write " << output.name() << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    output.path = std::move(*name);
+    return durable;
+}
+
+// A stdio stream for the output, writing files under their temporary name until closeFile();
+// descriptors are duplicated so closing the stream keeps them open
+auto openFile(const Output& output) -> FILE* {
+    FILE* fp = nullptr;
+    if (output.fd < 0) {
+        fp = fopen(temporaryPath(output.path).c_str(), "wbe");
+    } else if (auto copy = dup(output.fd); copy >= 0) {
+        fp = fdopen(copy, "wb");
+        if (fp == nullptr) {
+            ::close(copy);
+        }
+    }
+    if (fp == nullptr) {
+        std::cerr << "Failed to open " << output.name() << " for writing\n";
+    }
+    return fp;
+}
+
+/**
+ * A file written piece by piece over a whole session, like an animation or a recording.
+ *
+ * It stays under its temporary name until close() publishes it; a file that is never closed,
+ * e.g. after a failed write, is removed again.
+ */
+class SessionFile {
+  public:
+    SessionFile() = default;
+    SessionFile(const SessionFile&) = delete;
+    auto operator=(const SessionFile&) -> SessionFile& = delete;
+    SessionFile(SessionFile&&) = delete;
+    auto operator=(SessionFile&&) -> SessionFile& = delete;
+    ~SessionFile() { discard(); }
+
+    auto open(Output target) -> bool {
+        discard();
+        output = std::move(target);
+        fp = openFile(output);
+        return fp != nullptr;
+    }
+
+    [[nodiscard]] auto isOpen() const -> bool { return fp != nullptr; }
+    [[nodiscard]] auto name() const -> std::string { return output.name(); }
+
+    auto write(const std::vector<unsigned char>& data) -> bool {
+        return fwrite(data.data(), 1, data.size(), fp) == data.size();
+    }
+
+    // Current write offset; -1 for pipes and sockets, which cannot seek
+    [[nodiscard]] auto position() const -> long { return ftell(fp); }
+    auto seek(size_t offset) -> bool { return fseek(fp, static_cast<long>(offset), SEEK_SET) == 0; }
+
+    // Complete the file; `ok` is false when a write the caller checked failed
+    auto close(bool ok, SyncMode sync) -> bool {
+        return closeFile(std::exchange(fp, nullptr), ok, output, sync);
+    }
+
+    // Close without publishing and remove the temporary file
+    auto discard() -> void {
+        if (fp == nullptr) {
+            return;
+        }
+        fclose(std::exchange(fp, nullptr));
+        if (output.fd < 0) {
+            (void)unlink(temporaryPath(output.path).c_str());
+        }
+    }
+
+  private:
+    Output output;
+    FILE* fp = nullptr;
+};
+
+// The visible rows exactly as the frame buffer holds them, without row padding
+auto encodeRaw(const FrameView& frame, std::vector<unsigned char>& buffer) -> void {
+    const auto& format = frame.format;
+    auto rowBytes = (size_t{format.width} * format.bitsPerPixel + 7) / 8;
+    buffer.clear();
+    for (auto y = 0U; y < format.height; ++y) {
+        buffer.insert(buffer.end(), frame.row(y), frame.row(y) + rowBytes);
+    }
+}
+
+// Binary PPM (P6) of RGB888 rows
+auto encodePpm(FrameRows& rows, std::vector<unsigned char>& buffer) -> void {
+    auto header = "P6\n" + std::to_string(rows.width()) + " " + std::to_string(rows.height()) +
+                  "\n255\n";
+    auto rowBytes = size_t{rows.width()} * sizeof(RGB888);
+    buffer.assign(header.begin(), header.end());
+    for (auto y = 0U; y < rows.height(); ++y) {
+        buffer.insert(buffer.end(), rows.row(y), rows.row(y) + rowBytes);
+    }
+}
+
+/**
+ * 24-bit BMP of RGB888 rows.
+ *
+ * The negative height marks the rows as top-down, so they can be stored in the order they are
+ * produced; only the channel order has to be swapped to BMP's blue, green, red.
+ */
+auto encodeBmp(FrameRows& rows, std::vector<unsigned char>& buffer) -> void {
+    constexpr auto FILE_HEADER_SIZE = 14U;
+    constexpr auto INFO_HEADER_SIZE = 40U;
+
+    auto rowBytes = (size_t{rows.width()} * sizeof(RGB888) + 3) & ~size_t{3};
+    auto imageSize = static_cast<uint32_t>(rowBytes * rows.height());
+    auto dataOffset = FILE_HEADER_SIZE + INFO_HEADER_SIZE;
+
+    buffer.assign(dataOffset + size_t{imageSize}, 0);
+    auto put = [&buffer](size_t offset, uint32_t value, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            buffer[offset + i] = static_cast<unsigned char>(value >> (8 * i));
+        }
+    };
+    buffer[0] = 'B';
+    buffer[1] = 'M';
+    put(2, dataOffset + imageSize, 4);
+    put(10, dataOffset, 4);
+    put(14, INFO_HEADER_SIZE, 4);
+    put(18, rows.width(), 4);
+    put(22, static_cast<uint32_t>(-static_cast<int32_t>(rows.height())), 4);
+    put(26, 1, 2);  // planes
+    put(28, 24, 2); // bits per pixel
+    put(34, imageSize, 4);
+
+    for (auto y = 0U; y < rows.height(); ++y) {
+        const auto* row = rows.row(y);
+        auto* out = buffer.data() + dataOffset + y * rowBytes;
+        for (size_t x = 0; x < rows.width(); ++x) {
+            out[3 * x] = row[3 * x + 2];
+            out[3 * x + 1] = row[3 * x + 1];
+            out[3 * x + 2] = row[3 * x];
+        }
+    }
+}
+
+/**
+ * QOI ("Quite OK Image") encoding of RGB888 or RGBA8888 rows.
+ *
+ * A single pass over the pixels: runs of the previous pixel, a 64-entry hash of recently seen
+ * colors and small differences to the previous pixel each get a short code, anything else is
+ * stored verbatim.
+ */
+auto encodeQoi(FrameRows& rows, std::vector<unsigned char>& buffer) -> void {
+    constexpr auto OP_INDEX = 0x00U;
+    constexpr auto OP_DIFF = 0x40U;
+    constexpr auto OP_LUMA = 0x80U;
+    constexpr auto OP_RUN = 0xC0U;
+    constexpr auto OP_RGB = 0xFEU;
+    constexpr auto OP_RGBA = 0xFFU;
+    constexpr auto MAX_RUN = 62U;
+
+    using Pixel = std::array<unsigned char, 4>;
+    const auto channels = rows.format() == PixelFormat::Rgba8888 ? 4U : 3U;
+
+    buffer.clear();
+    auto push = [&buffer](uint32_t byte) { buffer.push_back(static_cast<unsigned char>(byte)); };
+    buffer.insert(buffer.end(), {'q', 'o', 'i', 'f'});
+    for (auto value : {rows.width(), rows.height()}) {
+        for (auto shift : {24U, 16U, 8U, 0U}) {
+            push(value >> shift);
+        }
+    }
+    push(channels);
+    push(0); // sRGB with linear alpha
+
+    auto index = std::array<Pixel, 64>();
+    auto previous = Pixel{0, 0, 0, COLOR_MAX};
+    auto run = 0U;
+    for (auto y = 0U; y < rows.height(); ++y) {
+        const auto* row = rows.row(y);
+        for (auto x = 0U; x < rows.width(); ++x, row += channels) {
+            auto alpha = channels == 4 ? row[3] : static_cast<unsigned char>(COLOR_MAX);
+            auto pixel = Pixel{row[0], row[1], row[2], alpha};
+            if (pixel == previous) {
+                if (++run == MAX_RUN) {
+                    push(OP_RUN | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                push(OP_RUN | (run - 1));
+                run = 0;
+            }
+
+            auto slot = (pixel[0] * 3U + pixel[1] * 5U + pixel[2] * 7U + pixel[3] * 11U) % 64;
+            if (index[slot] == pixel) {
+                push(OP_INDEX | slot);
+            } else if (pixel[3] != previous[3]) {
+                push(OP_RGBA);
+                buffer.insert(buffer.end(), pixel.begin(), pixel.end());
+            } else {
+                auto dr = static_cast<int8_t>(pixel[0] - previous[0]);
+                auto dg = static_cast<int8_t>(pixel[1] - previous[1]);
+                auto db = static_cast<int8_t>(pixel[2] - previous[2]);
+                auto drg = dr - dg;
+                auto dbg = db - dg;
+                auto small = [](int d, int low, int high) { return d >= low && d <= high; };
+                if (small(dr, -2, 1) && small(dg, -2, 1) && small(db, -2, 1)) {
+                    push(OP_DIFF | static_cast<uint32_t>((dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                } else if (small(dg, -32, 31) && small(drg, -8, 7) && small(dbg, -8, 7)) {
+                    push(OP_LUMA | static_cast<uint32_t>(dg + 32));
+                    push(static_cast<uint32_t>((drg + 8) << 4 | (dbg + 8)));
+                } else {
+                    push(OP_RGB);
+                    buffer.insert(buffer.end(), pixel.begin(), pixel.begin() + 3);
+                }
+            }
+            index[slot] = pixel;
+            previous = pixel;
+        }
+    }
+    if (run > 0) {
+        push(OP_RUN | (run - 1));
+    }
+    buffer.insert(buffer.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+}
+
+enum class Encoder : uint8_t { Libpng, Fast };
+
+// Filtered image bytes per deflate band; smaller images are compressed on the calling thread
+constexpr auto MIN_BAND_BYTES = size_t{64} * 1024;
+
+auto workerCount() -> size_t {
+    static const auto count = std::max(1U, std::thread::hardware_concurrency());
+    return count;
+}
+
+constexpr auto PNG_SIGNATURE = std::array<unsigned char, 8>{137, 80, 78, 71, 13, 10, 26, 10};
+constexpr auto ZLIB_HEADER = std::array<unsigned char, 2>{0x78, 0x01}; // 32K window, fastest
+
+/**
+ * Built-in PNG encoder for 8-bit truecolor, gray and palette images.
+ *
+ * Every row gets the same filter (Up, or None for palettes and the fastest profile) and the image
+ * goes through the Deflater above. Large images are split into bands of rows that are deflated
+ * on one thread each and joined into a single zlib stream, like pigz does. The file is assembled
+ * in memory and written at once; libpng stays the reference encoder.
+ */
+class PngEncoder {
+  public:
+    // Encode a complete PNG into `buffer`, reusing its capacity
+    auto encode(
+        FrameRows& rows,
+        const Compression& compression,
+        std::vector<unsigned char>& buffer
+    ) -> bool {
+        png.swap(buffer);
+        auto encoded = begin(rows);
+        if (encoded) {
+            auto idat = beginChunk("IDAT");
+            appendImage(rows, compression);
+            endChunk(idat);
+            endChunk(beginChunk("IEND"));
+        }
+        png.swap(buffer);
+        return encoded;
+    }
+
+    // Start a PNG in memory with the header chunks for images like `rows`; false if their pixel
+    // format cannot be stored
+    auto begin(const FrameRows& rows) -> bool {
+        const auto* palette = rows.palette();
+        const auto colorType =
+            palette != nullptr ? PNG_COLOR_TYPE_PALETTE : pngColorType(rows.format());
+        if (colorType < 0) {
+            std::cerr << "Pixel format cannot be written as PNG\n";
+            return false;
+        }
+        const auto bitDepth = palette != nullptr ? palette->bitDepth() : 8;
+
+        png.assign(PNG_SIGNATURE.begin(), PNG_SIGNATURE.end());
+
+        auto header = beginChunk("IHDR");
+        appendBigEndian(rows.width());
+        appendBigEndian(rows.height());
+        png.insert(
+            png.end(),
+            {static_cast<unsigned char>(bitDepth), static_cast<unsigned char>(colorType), 0, 0, 0}
+        );
+        endChunk(header);
+
+        if (palette != nullptr) {
+            auto plte = beginChunk("PLTE");
+            for (const auto& color : palette->colors()) {
+                png.insert(png.end(), {color.red, color.green, color.blue});
+            }
+            endChunk(plte);
+        }
+        return true;
+    }
+
+    // Append the filtered and compressed rows as a zlib stream to the current chunk
+    auto appendImage(FrameRows& rows, const Compression& compression) -> void {
+        const auto* palette = rows.palette();
+        const auto bitDepth = palette != nullptr ? palette->bitDepth() : 8;
+        const auto bitsPerPixel = palette != nullptr ? bitDepth : 8 * bytesPerPixel(rows.format());
+        const auto rowBytes = (size_t{rows.width()} * bitsPerPixel + 7) / 8;
+        const auto up = palette == nullptr && compression.filters != PNG_FILTER_NONE;
+
+        filtered.resize((rowBytes + 1) * rows.height());
+        prior.assign(rowBytes, 0);
+        auto* out = filtered.data();
+        for (auto y = 0U; y < rows.height(); ++y) {
+            const auto* row = rows.row(y);
+            if (bitDepth < 8) {
+                row = pack(row, rows.width(), bitDepth, rowBytes);
+            }
+            *out++ = up ? PNG_FILTER_VALUE_UP : PNG_FILTER_VALUE_NONE;
+            if (up) {
+                for (size_t i = 0; i < rowBytes; ++i) {
+                    out[i] = static_cast<unsigned char>(row[i] - prior[i]);
+                }
+                std::memcpy(prior.data(), row, rowBytes);
+            } else {
+                std::memcpy(out, row, rowBytes);
+            }
+            out += rowBytes;
+        }
+
+        png.insert(png.end(), ZLIB_HEADER.begin(), ZLIB_HEADER.end());
+        appendBigEndian(compress(rowBytes + 1, rows.height()));
+    }
+
+    // Append the lowest `bytes` bytes of `value`, most significant first
+    auto appendBigEndian(uint32_t value, uint32_t bytes = 4) -> void {
+        for (auto i = bytes; i > 0; --i) {
+            png.push_back(static_cast<unsigned char>(value >> (8 * (i - 1))));
+        }
+    }
+
+    // Start a chunk; returns its offset for endChunk()
+    auto beginChunk(const char* type) -> size_t {
+        auto offset = png.size();
+        appendBigEndian(0);
+        png.insert(png.end(), type, type + 4);
+        return offset;
+    }
+
+    // Fill in the length and append the CRC of the chunk started at `offset`
+    auto endChunk(size_t offset) -> void {
+        auto length = static_cast<uint32_t>(png.size() - offset - 8);
+        for (auto i = 0U; i < 4; ++i) {
+            png[offset + i] = static_cast<unsigned char>(length >> (24U - 8 * i));
+        }
+        appendBigEndian(crc32(0, png.data() + offset + 4, length + 4));
+    }
+
+    // Encoded bytes since begin() or clear()
+    [[nodiscard]] auto data() const -> const std::vector<unsigned char>& { return png; }
+    auto clear() -> void { png.clear(); }
+
+  private:
+
+    // Append the deflated filtered image to `png`; returns its Adler-32
+    auto compress(size_t lineBytes, size_t height) -> uint32_t {
+        auto count = std::max(size_t{1}, std::min(workerCount(), filtered.size() / MIN_BAND_BYTES));
+        auto bandRows = std::max(size_t{1}, (height + count - 1) / count);
+        count = std::max(size_t{1}, (height + bandRows - 1) / bandRows);
+        bands.resize(count);
+
+        auto run = [this, lineBytes, bandRows, count](size_t i) {
+            auto& band = bands[i];
+            const auto* data = filtered.data() + i * bandRows * lineBytes;
+            band.size = std::min(bandRows * lineBytes, filtered.size() - i * bandRows * lineBytes);
+            band.output.clear();
+            band.deflater.compress(data, band.size, i + 1 == count, band.output);
+            band.adler = adler32(1, data, band.size);
+        };
+        auto workers = std::vector<std::thread>();
+        for (size_t i = 1; i < count; ++i) {
+            try {
+                workers.emplace_back(run, i);
+            } catch (const std::system_error&) {
+                run(i);
+            }
+        }
+        run(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        auto adler = uint32_t{1};
+        for (const auto& band : bands) {
+            png.insert(png.end(), band.output.begin(), band.output.end());
+            adler = adler32Combine(adler, band.adler, band.size);
+        }
+        return adler;
+    }
+
+    // Indices packed `bitDepth` bits each, leftmost pixel in the high bits
+    auto pack(const unsigned char* indices, uint32_t width, int bitDepth, size_t rowBytes)
+        -> const unsigned char* {
+        packed.assign(rowBytes, 0);
+        auto perByte = 8U / static_cast<uint32_t>(bitDepth);
+        for (auto x = 0U; x < width; ++x) {
+            auto shift = 8U - static_cast<uint32_t>(bitDepth) * (x % perByte + 1);
+            packed[x / perByte] |= static_cast<unsigned char>(indices[x] << shift);
+        }
+        return packed.data();
+    }
+
+    // Rows compressed by one thread
+    struct Band {
+        Deflater deflater;
+        std::vector<unsigned char> output;
+        size_t size = 0;
+        uint32_t adler = 1;
+    };
+
+    std::vector<Band> bands;
+    std::vector<unsigned char> filtered; // filter type byte + row, for every row
+    std::vector<unsigned char> prior;
+    std::vector<unsigned char> packed;
+    std::vector<unsigned char> png;
+};
+
+// What capture does when every slot of the encode stage is taken
+enum class QueuePolicy : uint8_t {
+    Block, // wait for the encoder; timer ticks passing meanwhile are skipped
+    Drop,  // drop the new frame and carry its changes over to the next one
+};
+
+struct Options {
+    std::string baseName = "screenshot";
+    std::string directory;
+    std::string frameBufPath = FRAME_BUF_PATH;
+    bool includeDate = true;
+    bool tearFree = false;
+    PixelFormat color = PixelFormat::Rgb888;
+    bool palette = true;
+    Profile profile = Profile::Balanced;
+    Encoder encoder = Encoder::Libpng;
+    FileFormat format = FileFormat::Png;
+    bool animate = false;        // write a continuous session as one APNG
+    bool record = false;         // write a continuous session as one .fbrec recording
+    std::string extractPath;     // recording to extract instead of capturing
+    uint64_t firstFrame = 0;
+    uint64_t lastFrame = UINT64_MAX; // exclusive
+    bool continuous = false;
+    uint32_t intervalMs = DEFAULT_INTERVAL_MS;
+    uint64_t count = 0;          // 0: until SIGINT/SIGTERM
+    bool keepUnchanged = false;
+    uint32_t recorderSeconds = 0; // 0: write every frame instead of recording into a ring
+    std::string controlSocket;
+    std::string outputPath; // fixed output file instead of generated names
+    int outputFd = -1;      // descriptor to write to instead of a file
+    std::optional<NameTemplate> nameTemplate; // screenshot names instead of <name>-<date>-<n>
+    SyncMode sync = SyncMode::None;
+    uint64_t maxBytes = 0; // 0: no limit on the size of the session's files
+    uint64_t maxFiles = 0; // 0: no limit on their number
+    uint32_t queueDepth = DEFAULT_QUEUE_DEPTH;
+    QueuePolicy queuePolicy = QueuePolicy::Block;
+};
+
+template <typename T> auto parseNumber(std::string_view text, T& value) -> bool {
+    const auto* end = text.data() + text.size();
+    auto [ptr, ec] = std::from_chars(text.data(), end, value);
+    return ec == std::errc() && ptr == end;
+}
+
+// Bytes, optionally with a K, M or G suffix (powers of 1024)
+auto parseSize(std::string_view text, uint64_t& value) -> bool {
+    auto shift = 0U;
+    if (not text.empty()) {
+        switch (text.back()) {
+        case 'K':
+        case 'k':
+            shift = 10;
+            break;
+        case 'M':
+            shift = 20;
+            break;
+        case 'G':
+            shift = 30;
+            break;
+        default:
+            break;
+        }
+    }
+    if (shift != 0) {
+        text.remove_suffix(1);
+    }
+    if (not parseNumber(text, value) || value > (UINT64_MAX >> shift)) {
+        return false;
+    }
+    value <<= shift;
+    return true;
+}
+
+// "<first>" or "<first>-<last>", inclusive; `last` is returned exclusive
+auto parseRange(std::string_view text, uint64_t& first, uint64_t& last) -> bool {
+    auto dash = text.find('-');
+    if (not parseNumber(text.substr(0, dash), first)) {
+        return false;
+    }
+    if (dash == std::string_view::npos) {
+        last = first + 1;
+        return true;
+    }
+    auto inclusive = uint64_t{0};
+    if (not parseNumber(text.substr(dash + 1), inclusive) || inclusive < first) {
+        return false;
+    }
+    last = inclusive + 1;
+    return true;
+}
+
+auto parseEncoder(std::string_view name) -> std::optional<Encoder> {
+    if (name == "libpng") {
+        return Encoder::Libpng;
+    }
+    if (name == "fast") {
+        return Encoder::Fast;
+    }
+    return std::nullopt;
+}
+
+auto parseFormat(std::string_view name) -> std::optional<FileFormat> {
+    if (name == "png") {
+        return FileFormat::Png;
+    }
+    if (name == "ppm") {
+        return FileFormat::Ppm;
+    }
+    if (name == "bmp") {
+        return FileFormat::Bmp;
+    }
+    if (name == "raw565") {
+        return FileFormat::Raw565;
+    }
+    if (name == "qoi") {
+        return FileFormat::Qoi;
+    }
+    return std::nullopt;
+}
+
+auto parseSync(std::string_view name) -> std::optional<SyncMode> {
+    if (name == "none") {
+        return SyncMode::None;
+    }
+    if (name == "data") {
+        return SyncMode::Data;
+    }
+    if (name == "full") {
+        return SyncMode::Full;
+    }
+    return std::nullopt;
+}
+
+auto parseQueuePolicy(std::string_view name) -> std::optional<QueuePolicy> {
+    if (name == "block") {
+        return QueuePolicy::Block;
+    }
+    if (name == "drop") {
+        return QueuePolicy::Drop;
+    }
+    return std::nullopt;
+}
+
+auto parseColor(std::string_view name) -> std::optional<PixelFormat> {
+    if (name == "rgb") {
+        return PixelFormat::Rgb888;
+    }
+    if (name == "rgba") {
+        return PixelFormat::Rgba8888;
+    }
+    if (name == "gray") {
+        return PixelFormat::Gray8;
+    }
+    return std::nullopt;
+}
+
+/**
+ * Write an encoded file with a single write.
+ *
+ * New files get their full size allocated up front, so the SD card sees one extent and one
+ * write instead of a file growing through stdio's small buffer. They are written under a
+ * temporary name and renamed once complete; `output` is updated if the name had to change.
+ * Returns whether the file was published; `durable` is cleared if its directory failed to sync.
+ */
+auto writeFile(Output& output, const std::vector<unsigned char>& data, SyncMode sync, bool& durable)
+    -> bool {
+    if (output.fd >= 0) {
+        if (not writeAll(output.fd, data.data(), data.size())) {
+            std::cerr << "Failed to write " << output.name() << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    auto temp = temporaryPath(output.path);
+    auto fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open " << output.name() << " for writing\n";
+        return false;
+    }
+    if (not data.empty()) {
+        (void)fallocate(fd, 0, 0, static_cast<off_t>(data.size())); // optional, may be unsupported
+    }
+    auto dir = sync == SyncMode::Full ? openDirectory(output.path) : UniqueFd();
+    auto name = std::optional<std::string>();
+    if (writeAll(fd, data.data(), data.size())) {
+        name = publish(fd, dir.get(), output.path, sync, output.exclusive, durable);
+    } else {
+        discardTemporary(fd, output.path);
+    }
+    if (not name) {
+        std::cerr << "Failed to write " << output.name() << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+    output.path = std::move(*name);
+    return true;
+}
+
+#if defined(SCREENSHOT_IO_URING)
+/**
+ * Submission and completion rings of an io_uring instance.
+ *
+ * Set up through the raw system calls, so the tool keeps building and running without liburing.
+ * Requests are not polled by the kernel: they are handed over on enter().
+ */
+class IoUring {
+  public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    auto operator=(const IoUring&) -> IoUring& = delete;
+    ~IoUring() {
+        if (sqes != nullptr) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != nullptr && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != nullptr) {
+            munmap(sqRing, sqRingSize);
+        }
+    }
+
+    // Set up rings for `entries` requests; false when the kernel lacks io_uring or one of `ops`
+    auto setup(unsigned entries, std::initializer_list<unsigned> ops) -> bool {
+        auto params = io_uring_params{};
+        ringFd.reset(static_cast<int>(syscall(__NR_io_uring_setup, entries, &params)));
+        if (not ringFd.valid() || not supports(ops)) {
+            ringFd.reset();
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        auto single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = map(sqRingSize, IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing : map(cqRingSize, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(map(sqesSize, IORING_OFF_SQES));
+        if (sqRing == nullptr || cqRing == nullptr || sqes == nullptr) {
+            ringFd.reset();
+            return false;
+        }
+
+        sqHead = field(sqRing, params.sq_off.head);
+        sqTail = field(sqRing, params.sq_off.tail);
+        sqMask = *field(sqRing, params.sq_off.ring_mask);
+        sqArray = field(sqRing, params.sq_off.array);
+        sqEntries = params.sq_entries;
+        cqHead = field(cqRing, params.cq_off.head);
+        cqTail = field(cqRing, params.cq_off.tail);
+        cqMask = *field(cqRing, params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>( // NOLINT (reinterpret_cast)
+            static_cast<unsigned char*>(cqRing) + params.cq_off.cqes
+        );
+        tail = *sqTail;
+        return true;
+    }
+
+    [[nodiscard]] auto valid() const -> bool { return ringFd.valid(); }
+
+    // A cleared submission entry, handed to the kernel on the next enter(); nullptr when full
+    auto next() -> io_uring_sqe* {
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+            return nullptr;
+        }
+        auto index = tail & sqMask;
+        sqes[index] = io_uring_sqe{};
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, ++tail, __ATOMIC_RELEASE);
+        return &sqes[index];
+    }
+
+    // Submit the prepared entries and wait for at least `wait` completions
+    auto enter(unsigned wait) -> bool {
+        while (true) {
+            auto submit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (submit == 0 && wait == 0) {
+                return true;
+            }
+            auto flags = wait != 0 ? unsigned{IORING_ENTER_GETEVENTS} : 0U;
+            if (syscall(__NR_io_uring_enter, ringFd.get(), submit, wait, flags, nullptr, 0) >= 0) {
+                return true;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                return false;
+            }
+        }
+    }
+
+    // Pass every available completion to `handle(userData, result)`
+    template <typename Handler> auto reap(Handler handle) -> void {
+        auto head = *cqHead;
+        auto end = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != end; ++head) {
+            const auto& cqe = cqes[head & cqMask];
+            handle(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+  private:
+    auto map(size_t size, uint64_t offset) const -> void* {
+        auto* address = mmap(
+            nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd.get(),
+            static_cast<off_t>(offset)
+        );
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    static auto field(void* ring, uint32_t offset) -> unsigned* {
+        return reinterpret_cast<unsigned*>( // NOLINT (reinterpret_cast)
+            static_cast<unsigned char*>(ring) + offset
+        );
+    }
+
+    // Older kernels have io_uring but not every operation
+    auto supports(std::initializer_list<unsigned> ops) const -> bool {
+        constexpr auto PROBE_OPS = 256U;
+        auto storage = std::vector<unsigned char>(
+            sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op)
+        );
+        auto* probe = reinterpret_cast<io_uring_probe*>(storage.data()); // NOLINT
+        if (syscall(__NR_io_uring_register, ringFd.get(), IORING_REGISTER_PROBE, probe, PROBE_OPS) <
+            0) {
+            return false;
+        }
+        return std::all_of(ops.begin(), ops.end(), [&](unsigned op) {
+            return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+        });
+    }
+
+    UniqueFd ringFd;
+    void* sqRing = nullptr;
+    size_t sqRingSize = 0;
+    void* cqRing = nullptr;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned tail = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+};
+#endif
+
+// Old files deleted at most per saved file, so catching up with a lowered budget stays gradual
+constexpr auto MAX_DELETIONS_PER_FILE = 4U;
+
+/**
+ * Keeps the files of a continuous session within a disk budget.
+ *
+ * Every file the session saves is added to an in-memory index with its size; once the budget is
+ * exceeded the oldest ones are deleted, a few per new file. The directory is never rescanned, so
+ * files that were there before the session do not count. Directories left empty by a deletion
+ * (e.g. from a name template) are removed as well. add() only picks the files to delete and
+ * purge() deletes them, so callers can add under a lock and leave the slow part outside of it.
+ */
+class Retention {
+  public:
+    // 0 for no limit
+    Retention(uint64_t maxBytes, uint64_t maxFiles) : maxBytes(maxBytes), maxFiles(maxFiles) {}
+
+    [[nodiscard]] auto enabled() const -> bool { return maxBytes != 0 || maxFiles != 0; }
+
+    // Record a saved file and pick the oldest files to delete while over the budget
+    auto add(const std::string& path, uint64_t size) -> void {
+        if (not enabled()) {
+            return;
+        }
+        files.push_back(Entry{path, size});
+        bytes += size;
+
+        // the newest file stays, even when it alone exceeds the budget
+        for (auto deleted = 0U; deleted < MAX_DELETIONS_PER_FILE && files.size() > 1 && over();
+             ++deleted) {
+            auto oldest = std::move(files.front());
+            files.pop_front();
+            bytes -= oldest.size;
+            auto last = directoryOf(files.front().path) != directoryOf(oldest.path);
+            expired.push_back(Expired{std::move(oldest.path), last});
+        }
+    }
+
+    // Delete the files picked by add()
+    auto purge() -> void {
+        for (const auto& file : expired) {
+            if (unlink(file.path.c_str()) != 0 && errno != ENOENT) {
+                std::cerr << "Failed to delete " << file.path << ": " << std::strerror(errno)
+                          << "\n";
+                continue;
+            }
+            // the last file of its directory: remove the directory if nothing else is in it
+            if (file.lastInDirectory) {
+                (void)rmdir(directoryOf(file.path).c_str());
+            }
+        }
+        expired.clear();
+    }
+
+  private:
+    struct Entry {
+        std::string path;
+        uint64_t size;
+    };
+
+    struct Expired {
+        std::string path;
+        bool lastInDirectory;
+    };
+
+    [[nodiscard]] auto over() const -> bool {
+        return (maxBytes != 0 && bytes > maxBytes) || (maxFiles != 0 && files.size() > maxFiles);
+    }
+
+    uint64_t maxBytes;
+    uint64_t maxFiles;
+    std::deque<Entry> files; // oldest first
+    uint64_t bytes = 0;
+    std::vector<Expired> expired; // picked by add(), deleted by purge()
+};
+
+// Files being written at once; further frames wait until one of them is done
+constexpr auto MAX_IN_FLIGHT = 4U;
+
+// With full durability, directories are synced at most this often while capturing
+constexpr auto DIRECTORY_SYNC_INTERVAL_US = uint64_t{1'000'000};
+
+auto monotonicUs() -> uint64_t {
+    auto now = timespec{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1'000'000 +
+           static_cast<uint64_t>(now.tv_nsec) / 1000;
+}
+
+/**
+ * Writes encoded files in the background, so encoding the next frame overlaps with the storage
+ * latency of the previous ones.
+ *
+ * Each file is written under its temporary name, synced as the mode asks, closed and renamed to
+ * its generated name, through io_uring where the kernel supports it or by a thread otherwise. At
+ * most MAX_IN_FLIGHT files are pending; their buffers go back to a pool for the following frames
+ * once written, and the files to the retention index. With full durability the directories of
+ * the new names are synced together, once per DIRECTORY_SYNC_INTERVAL_US and on drain().
+ * Failures are reported when the writes complete, so submit() and drain() return false for a
+ * file that failed earlier.
+ */
+class WriteQueue {
+  public:
+    WriteQueue(SyncMode sync, Retention& retention) : sync(sync), retention(retention) {
+#if defined(SCREENSHOT_IO_URING)
+        if (ring.setup(
+                MAX_IN_FLIGHT,
+                {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE,
+                 IORING_OP_RENAMEAT}
+            )) {
+            return;
+        }
+#endif
+        try {
+            worker = std::thread([this] { work(); });
+        } catch (const std::system_error&) {
+            // no thread either: submit() writes synchronously
+        }
+    }
+    WriteQueue(const WriteQueue&) = delete;
+    auto operator=(const WriteQueue&) -> WriteQueue& = delete;
+    ~WriteQueue() {
+        drain();
+        if (worker.joinable()) {
+            {
+                auto lock = std::lock_guard(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            worker.join();
+        }
+    }
+
+    // An empty buffer for encoding the next file, with the capacity of an earlier one if possible
+    auto takeBuffer() -> std::vector<unsigned char> {
+        if (pool.empty()) {
+            return {};
+        }
+        auto buffer = std::move(pool.back());
+        pool.pop_back();
+        buffer.clear();
+        return buffer;
+    }
+
+    // Queue a file with a generated name, waiting for a free slot first; false once any write
+    // has failed
+    auto submit(std::string path, std::vector<unsigned char> data) -> bool {
+        auto slot = freeSlot();
+        if (not slot) {
+            return false;
+        }
+        auto& job = jobs[*slot];
+        job.kind = Kind::File;
+        job.temp = temporaryPath(path);
+        job.name = path;
+        job.path = std::move(path);
+        job.data = std::move(data);
+        start(*slot);
+        collect();
+        return not failed;
+    }
+
+    // Wait until every queued file is written and synced; false if any write failed
+    auto drain() -> bool {
+        while (true) {
+            collect();
+            syncDirectories(true);
+            auto lock = std::unique_lock(mutex);
+            auto busy = not unsynced.empty() ||
+                        std::any_of(jobs.begin(), jobs.end(), [](const Job& job) {
+                            return job.stage != Stage::Free;
+                        });
+            lock.unlock();
+            if (not busy) {
+                return not failed;
+            }
+            if (not wait()) {
+                return abandon();
+            }
+        }
+    }
+
+  private:
+    enum class Kind : uint8_t { File, Directory };
+    enum class Stage : uint8_t { Free, Queued, Open, Write, Sync, Close, Rename, Done };
+
+    struct Job {
+        Kind kind = Kind::File;
+        std::string name; // the generated name
+        std::string path; // the name it gets, or the directory to sync
+        std::string temp;
+        std::vector<unsigned char> data;
+        size_t written = 0;
+        uint64_t counter = 0;      // of the name, when the generated one was taken
+        uint32_t renameFlags = 0;  // RENAME_NOREPLACE until the file system rejects it
+        int fd = -1;
+        int error = 0;
+        Stage stage = Stage::Free;
+    };
+
+    // Index of a free job, waiting for pending writes while all are in use
+    auto freeSlot() -> std::optional<size_t> {
+        while (true) {
+            collect();
+            if (auto slot = findFree()) {
+                return slot;
+            }
+            if (not wait()) {
+                abandon();
+                return std::nullopt;
+            }
+        }
+    }
+
+    auto findFree() -> std::optional<size_t> {
+        auto lock = std::lock_guard(mutex);
+        for (auto slot = size_t{0}; slot < jobs.size(); ++slot) {
+            if (jobs[slot].stage == Stage::Free) {
+                return slot;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Hand a filled in job to the ring, the worker or, without either, write it right away
+    auto start(size_t slot) -> void {
+        auto& job = jobs[slot];
+        job.written = 0;
+        job.counter = 0;
+        job.renameFlags = RENAME_NOREPLACE;
+        job.fd = -1;
+        job.error = 0;
+#if defined(SCREENSHOT_IO_URING)
+        if (ring.valid()) {
+            job.stage = Stage::Open;
+            prepare(slot);
+            if (not ring.enter(0)) {
+                abandon();
+            }
+            return;
+        }
+#endif
+        if (worker.joinable()) {
+            {
+                auto lock = std::lock_guard(mutex);
+                job.stage = Stage::Queued;
+                queued.push_back(slot);
+            }
+            changed.notify_all();
+        } else {
+            write(job);
+            job.stage = Stage::Done;
+        }
+    }
+
+    // Block until at least one more write has completed
+    auto wait() -> bool {
+#if defined(SCREENSHOT_IO_URING)
+        if (ring.valid()) {
+            return ring.enter(1);
+        }
+#endif
+        auto lock = std::unique_lock(mutex);
+        changed.wait(lock, [this] {
+            return std::any_of(jobs.begin(), jobs.end(), [](const Job& job) {
+                return job.stage == Stage::Done;
+            });
+        });
+        return true;
+    }
+
+    // Advance jobs on their completions, then report and recycle the finished ones
+    auto collect() -> void {
+#if defined(SCREENSHOT_IO_URING)
+        if (ring.valid()) {
+            ring.reap([this](uint64_t slot, int result) { advance(slot, result); });
+            if (not ring.enter(0)) {
+                abandon();
+                return;
+            }
+        }
+#endif
+        {
+            auto lock = std::lock_guard(mutex);
+            for (auto& job : jobs) {
+                if (job.stage == Stage::Done) {
+                    finish(job);
+                    job.stage = Stage::Free;
+                }
+            }
+        }
+        // deleting old files can take long on slow storage, so the worker is not held up by it
+        retention.purge();
+        syncDirectories(false);
+    }
+
+    auto finish(Job& job) -> void {
+        if (job.kind == Kind::Directory) {
+            if (job.error != 0) {
+                std::cerr << "Failed to sync directory " << job.path << ": "
+                          << std::strerror(job.error) << "\n";
+                failed = true;
+            }
+            return;
+        }
+
+        if (job.error != 0) {
+            std::cerr << "Failed to write " << job.name << ": " << std::strerror(job.error)
+                      << "\n";
+            (void)unlink(job.temp.c_str());
+            failed = true;
+        } else {
+            if (job.path != job.name) {
+                std::cout << job.name << " was taken meanwhile, saved as " << job.path << "\n";
+            }
+            retention.add(job.path, job.data.size());
+            auto directory = directoryOf(job.path);
+            if (sync == SyncMode::Full &&
+                std::find(unsynced.begin(), unsynced.end(), directory) == unsynced.end()) {
+                unsynced.push_back(std::move(directory));
+            }
+        }
+        pool.push_back(std::move(job.data));
+    }
+
+    // Sync the directories of new names when the batch is due, or now when `force`d
+    auto syncDirectories(bool force) -> void {
+        auto now = monotonicUs();
+        auto due = force || now - lastDirectorySync >= DIRECTORY_SYNC_INTERVAL_US;
+        if (unsynced.empty() || not due) {
+            return;
+        }
+        while (not unsynced.empty()) {
+            auto slot = findFree();
+            if (not slot) {
+                return; // the rest goes with a later call
+            }
+            auto& job = jobs[*slot];
+            job.kind = Kind::Directory;
+            job.path = std::move(unsynced.back());
+            unsynced.pop_back();
+            start(*slot);
+        }
+        lastDirectorySync = now;
+    }
+
+    // The ring stopped accepting requests: give up on the files still pending
+    auto abandon() -> bool {
+        std::cerr << "Failed to submit writes\n";
+        for (auto& job : jobs) {
+            job.stage = Stage::Free;
+        }
+        unsynced.clear();
+        failed = true;
+        return false;
+    }
+
+#if defined(SCREENSHOT_IO_URING)
+    // Queue the request for the job's current stage
+    auto prepare(size_t slot) -> void {
+        auto& job = jobs[slot];
+        if (job.stage == Stage::Write && job.written == job.data.size()) {
+            job.stage = sync == SyncMode::None ? Stage::Close : Stage::Sync;
+        }
+        // one request per job at a time, so the ring (MAX_IN_FLIGHT entries) never overflows
+        auto* sqe = ring.next();
+        sqe->user_data = slot;
+        switch (job.stage) {
+        case Stage::Open:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            if (job.kind == Kind::Directory) {
+                sqe->addr = reinterpret_cast<uintptr_t>(job.path.c_str()); // NOLINT
+                sqe->open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+            } else {
+                sqe->addr = reinterpret_cast<uintptr_t>(job.temp.c_str()); // NOLINT
+                sqe->len = 0644;
+                sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            }
+            break;
+        case Stage::Write:
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = job.fd;
+            sqe->addr = reinterpret_cast<uintptr_t>(job.data.data() + job.written); // NOLINT
+            sqe->len = static_cast<uint32_t>(
+                std::min(job.data.size() - job.written, size_t{UINT32_MAX})
+            );
+            sqe->off = job.written;
+            break;
+        case Stage::Sync:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = job.fd;
+            sqe->fsync_flags = sync == SyncMode::Data && job.kind == Kind::File
+                                   ? unsigned{IORING_FSYNC_DATASYNC}
+                                   : 0U;
+            break;
+        case Stage::Rename:
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uintptr_t>(job.temp.c_str()); // NOLINT
+            sqe->len = static_cast<uint32_t>(AT_FDCWD);
+            sqe->addr2 = reinterpret_cast<uintptr_t>(job.path.c_str()); // NOLINT
+            sqe->rename_flags = job.renameFlags;
+            break;
+        case Stage::Close:
+        default:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = job.fd;
+            break;
+        }
+    }
+
+    // Move a job to its next stage on the completion of its current request
+    auto advance(uint64_t slot, int result) -> void {
+        auto& job = jobs[slot];
+        switch (job.stage) {
+        case Stage::Open:
+            if (result < 0) {
+                job.error = -result;
+                job.stage = Stage::Done;
+                return;
+            }
+            job.fd = result;
+            job.stage = job.kind == Kind::Directory ? Stage::Sync : Stage::Write;
+            break;
+        case Stage::Write:
+            if (result <= 0) {
+                job.error = result < 0 ? -result : EIO;
+                job.stage = Stage::Close;
+            } else {
+                job.written += static_cast<size_t>(result);
+            }
+            break;
+        case Stage::Sync:
+            if (result < 0) {
+                job.error = -result;
+            }
+            job.stage = Stage::Close;
+            break;
+        case Stage::Close:
+            if (result < 0 && job.error == 0) {
+                job.error = -result;
+            }
+            job.fd = -1;
+            if (job.error != 0 || job.kind == Kind::Directory) {
+                job.stage = Stage::Done;
+                return;
+            }
+            job.stage = Stage::Rename;
+            break;
+        case Stage::Rename:
+            if (result == -EEXIST) {
+                job.path = numberedPath(job.name, ++job.counter);
+            } else if (result == -EINVAL && job.renameFlags != 0) {
+                job.renameFlags = 0; // not supported by the file system
+            } else {
+                job.error = result < 0 ? -result : 0;
+                job.stage = Stage::Done;
+                return;
+            }
+            break;
+        default:
+            return;
+        }
+        prepare(slot);
+    }
+#endif
+
+    // Fallback thread: write the queued files in order
+    auto work() -> void {
+        auto lock = std::unique_lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] { return stopping || not queued.empty(); });
+            if (queued.empty()) {
+                return;
+            }
+            auto slot = queued.front();
+            queued.pop_front();
+            lock.unlock();
+            write(jobs[slot]);
+            lock.lock();
+            jobs[slot].stage = Stage::Done;
+            changed.notify_all();
+        }
+    }
+
+    // Write, sync, close and publish a file, or sync a directory, on the calling thread
+    auto write(Job& job) const -> void {
+        if (job.kind == Kind::Directory) {
+            job.error = syncDirectory(job.path) ? 0 : errno;
+            return;
+        }
+
+        auto fd = open(job.temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            job.error = errno;
+            return;
+        }
+        while (job.written < job.data.size()) {
+            auto chunk = iovec{job.data.data() + job.written, job.data.size() - job.written};
+            auto result = pwritev(fd, &chunk, 1, static_cast<off_t>(job.written));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                job.error = result < 0 ? errno : EIO;
+                break;
+            }
+            job.written += static_cast<size_t>(result);
+        }
+        if (job.error != 0) {
+            discardTemporary(fd, job.name);
+            return;
+        }
+        // directories are synced in batches
+        auto durable = true;
+        auto name = publish(fd, -1, job.name, sync, true, durable);
+        job.error = name ? 0 : errno;
+        job.path = name ? std::move(*name) : job.name;
+    }
+
+    SyncMode sync;
+    Retention& retention;
+    std::array<Job, MAX_IN_FLIGHT> jobs{};
+    std::vector<std::vector<unsigned char>> pool; // buffers of written files
+    std::vector<std::string> unsynced;            // directories with new names
+    uint64_t lastDirectorySync = 0;
+    bool failed = false;
+#if defined(SCREENSHOT_IO_URING)
+    IoUring ring;
+#endif
+    std::thread worker;
+    std::mutex mutex; // guards the job stages and the queue shared with the worker
+    std::condition_variable changed;
+    std::deque<size_t> queued;
+    bool stopping = false;
+};
+
+// Names generated for files of this extension, from the template if one is given
+auto namerFor(
+    const Options& options,
+    std::string_view extension,
+    std::optional<NameTemplate> nameTemplate = std::nullopt
+) -> FileNamer {
+    return FileNamer(
+        options.directory, options.baseName, extension, options.includeDate, std::move(nameTemplate)
+    );
+}
+
+// Where the next file goes: the fixed output of -o or --fd, or a newly claimed file name
+auto outputFor(const Options& options, FileNamer& namer, const NameFields& fields)
+    -> std::optional<Output> {
+    if (options.outputFd >= 0) {
+        return Output{"", options.outputFd, false};
+    }
+    if (not options.outputPath.empty()) {
+        return Output{options.outputPath, -1, false};
+    }
+    auto path = namer.claim(fields);
+    if (not path) {
+        return std::nullopt;
+    }
+    return Output{std::move(*path), -1, true};
+}
+
+/**
+ * Converts, encodes and saves frames, keeping its buffers and palette across the frames of a
+ * session.
+ *
+ * With a write queue, files go to it and the next frame is encoded while they are written;
+ * descriptor outputs are still written in order, before save() returns.
+ */
+class FrameWriter {
+  public:
+    explicit FrameWriter(
+        const Options& options, WriteQueue* queue = nullptr, Retention* retention = nullptr
+    )
+        : options(options), queue(queue), retention(retention),
+          namer(namerFor(options, fileExtension(options.format), options.nameTemplate)) {}
+
+    // Save a frame; `index` is its capture index in the session, for name templates
+    auto save(const FrameView& frame, const Rect& dirty, time_t timestamp, uint64_t index = 0)
+        -> bool {
+        // room for the worst case of every format (5 bytes per pixel for QOI), so encoding
+        // never reallocates
+        buffer.reserve(size_t{frame.format.width} * frame.format.height * 5 + ENCODED_HEADROOM);
+
+        if (not encode(frame)) {
+            return false;
+        }
+        auto fields = NameFields{timestamp, index, dirty, buffer.data(), buffer.size()};
+        auto output = outputFor(options, namer, fields);
+        if (not output) {
+            return false;
+        }
+        // claimed names are unique, so their writes may complete in any order
+        auto durable = true;
+        if (queue != nullptr && output->fd < 0 && options.outputPath.empty()) {
+            if (not queue->submit(output->path, std::move(buffer))) {
+                return false;
+            }
+            buffer = queue->takeBuffer();
+        } else if (not writeFile(*output, buffer, options.sync, durable)) {
+            return false;
+        } else if (retention != nullptr && output->exclusive) {
+            // also when its directory failed to sync: the file is there and counts
+            retention->add(output->path, buffer.size());
+            retention->purge();
+        }
+
+        std::cout << "Screenshot saved as " << output->name();
+        if (dirty.width != frame.format.width || dirty.height != frame.format.height) {
+            std::cout << " (changed " << dirty.width << "x" << dirty.height << "+" << dirty.x
+                      << "+" << dirty.y << ")";
+        }
+        std::cout << "\n";
+        return durable;
+    }
+
+  private:
+    // Encode the frame in the output format into `buffer`
+    auto encode(const FrameView& frame) -> bool {
+        switch (options.format) {
+        case FileFormat::Raw565:
+            encodeRaw(frame, buffer);
+            return true;
+        case FileFormat::Ppm:
+            rows.assign(frame, PixelFormat::Rgb888);
+            encodePpm(rows, buffer);
+            return true;
+        case FileFormat::Bmp:
+            rows.assign(frame, PixelFormat::Rgb888);
+            encodeBmp(rows, buffer);
+            return true;
+        case FileFormat::Qoi:
+            rows.assign(
+                frame,
+                options.color == PixelFormat::Rgba8888 ? PixelFormat::Rgba8888
+                                                       : PixelFormat::Rgb888
+            );
+            encodeQoi(rows, buffer);
+            return true;
+        case FileFormat::Png:
+        default:
+            break;
+        }
+
+        if (options.palette && options.color == PixelFormat::Rgb888 && palette.build(frame)) {
+            rows.assign(frame, palette);
+        } else {
+            rows.assign(frame, options.color);
+        }
+        auto compression = compressionFor(options.profile, frame);
+        return options.encoder == Encoder::Fast ? encoder.encode(rows, compression, buffer)
+                                                : encodePng(rows, compression, buffer);
+    }
+
+    const Options& options;
+    WriteQueue* queue;
+    Retention* retention;
+    FileNamer namer;
+    FrameRows rows;
+    FramePalette palette;
+    PngEncoder encoder;
+    std::vector<unsigned char> buffer; // the encoded file
+};
+
+// APNG frame control ops (fcTL)
+constexpr auto APNG_DISPOSE_OP_NONE = 0U;
+constexpr auto APNG_BLEND_OP_SOURCE = 0U;
+
+// Largest numerator or denominator of an APNG frame delay
+constexpr auto MAX_DELAY_FIELD = 0xFFFFU;
+
+/**
+ * Writes the frames of a continuous session into a single animated PNG.
+ *
+ * The first frame is the default image; every later frame only stores the rectangle that
+ * changed, drawn over the previous frame. Unchanged frames add nothing but extend the delay of the
+ * frame on screen, so delays follow the capture timestamps. A frame is held back until the next
+ * one arrives because its delay is only known then. libpng cannot write APNG, so the frames go
+ * through the built-in encoder.
+ */
+class AnimationWriter {
+  public:
+    explicit AnimationWriter(const Options& options) : options(options) {}
+
+    // Add a frame captured at `timeMs`; `dirty` is the part that changed since the last frame
+    auto add(const FrameView& frame, const Rect& dirty, uint64_t timeMs) -> bool {
+        if (not file.isOpen()) {
+            return start(frame, timeMs);
+        }
+        if (dirty.empty()) {
+            return true;
+        }
+        if (not flush(timeMs)) {
+            return false;
+        }
+
+        rows.assign(crop(frame, dirty), options.color);
+        encoder.clear();
+        auto fdat = encoder.beginChunk("fdAT");
+        encoder.appendBigEndian(sequence + 1);
+        encoder.appendImage(rows, compressionFor(options.profile, frame));
+        encoder.endChunk(fdat);
+        pending.assign(encoder.data().begin(), encoder.data().end());
+        pendingRect = dirty;
+        pendingTime = timeMs;
+        return true;
+    }
+
+    // Write the last frame, shown for one capture interval, and complete the file
+    auto finish() -> bool {
+        if (not file.isOpen()) {
+            return true;
+        }
+        auto ok = flush(pendingTime + options.intervalMs);
+        encoder.clear();
+        encoder.endChunk(encoder.beginChunk("IEND"));
+        ok = ok && file.write(encoder.data());
+
+        // the frame count is only known now
+        encoder.clear();
+        auto actl = encoder.beginChunk("acTL");
+        encoder.appendBigEndian(frames);
+        encoder.appendBigEndian(0); // loop forever
+        encoder.endChunk(actl);
+        ok = ok && file.seek(actlOffset) && file.write(encoder.data());
+
+        if (not file.close(ok, options.sync)) {
+            return false;
+        }
+        std::cout << "Animation saved as " << file.name() << " (" << frames << " frames)\n";
+        return true;
+    }
+
+  private:
+    // Open the file and write the header and the first, complete frame
+    auto start(const FrameView& frame, uint64_t timeMs) -> bool {
+        auto namer = namerFor(options, ".png", options.nameTemplate);
+        auto fields = NameFields();
+        fields.timestamp = time(nullptr);
+        fields.dirty = Rect{0, 0, frame.format.width, frame.format.height};
+        auto claimed = outputFor(options, namer, fields);
+        if (not claimed) {
+            return false;
+        }
+        rows.assign(frame, options.color);
+        if (not encoder.begin(rows)) {
+            return false;
+        }
+        actlOffset = encoder.data().size();
+        auto actl = encoder.beginChunk("acTL");
+        encoder.appendBigEndian(0);
+        encoder.appendBigEndian(0);
+        encoder.endChunk(actl);
+
+        if (not file.open(std::move(*claimed))) {
+            return false;
+        }
+        // the frame count in acTL is written last, which needs a seekable file
+        auto base = file.position();
+        if (base < 0) {
+            std::cerr << "Animated PNGs cannot be written to a pipe or socket\n";
+            file.discard();
+            return false;
+        }
+        actlOffset += static_cast<size_t>(base);
+        if (not file.write(encoder.data())) {
+            return false;
+        }
+
+        encoder.clear();
+        auto idat = encoder.beginChunk("IDAT");
+        encoder.appendImage(rows, compressionFor(options.profile, frame));
+        encoder.endChunk(idat);
+        pending.assign(encoder.data().begin(), encoder.data().end());
+        pendingRect = Rect{0, 0, frame.format.width, frame.format.height};
+        pendingTime = timeMs;
+        return true;
+    }
+
+    // Write the held back frame, shown until `timeMs`
+    auto flush(uint64_t timeMs) -> bool {
+        auto delay = timeMs - pendingTime;
+        auto denominator = 1000U;
+        while (delay > MAX_DELAY_FIELD && denominator > 1) {
+            delay /= 10;
+            denominator /= 10;
+        }
+
+        auto numerator = static_cast<uint32_t>(std::min(delay, uint64_t{MAX_DELAY_FIELD}));
+
+        encoder.clear();
+        auto fctl = encoder.beginChunk("fcTL");
+        encoder.appendBigEndian(sequence);
+        encoder.appendBigEndian(pendingRect.width);
+        encoder.appendBigEndian(pendingRect.height);
+        encoder.appendBigEndian(pendingRect.x);
+        encoder.appendBigEndian(pendingRect.y);
+        encoder.appendBigEndian(numerator, 2);
+        encoder.appendBigEndian(denominator, 2);
+        encoder.appendBigEndian(APNG_DISPOSE_OP_NONE, 1);
+        encoder.appendBigEndian(APNG_BLEND_OP_SOURCE, 1);
+        encoder.endChunk(fctl);
+
+        sequence += frames == 0 ? 1 : 2; // the default image has no sequence number
+        ++frames;
+        return file.write(encoder.data()) && file.write(pending);
+    }
+
+    const Options& options;
+    FrameRows rows;
+    PngEncoder encoder;
+    SessionFile file;
+    size_t actlOffset = 0;
+    uint32_t sequence = 0; // next fcTL/fdAT sequence number
+    uint32_t frames = 0;   // frames written
+    std::vector<unsigned char> pending; // IDAT or fdAT chunk of the held back frame
+    Rect pendingRect;
+    uint64_t pendingTime = 0;
+};
+
+// Native session recordings (.fbrec), little endian throughout:
+//   header | records | index | trailer
+// Each record holds one frame as a keyframe (all pixels) or as the XOR of its changed rectangle
+// with the previous frame, deflated.
+constexpr auto RECORDING_MAGIC = std::string_view("FBREC001");
+constexpr auto INDEX_MAGIC = std::string_view("FBRECIDX");
+constexpr auto RECORDING_HEADER_SIZE = 40U; // magic, geometry, channels, interval, start time
+constexpr auto RECORD_HEADER_SIZE = 24U;    // type, size, timestamp, rectangle
+constexpr auto INDEX_ENTRY_SIZE = 8U;       // record offset
+constexpr auto TRAILER_SIZE = 24U;          // index offset, frame count, magic
+
+// Stored frames from one keyframe to the next
+constexpr auto KEYFRAME_INTERVAL = 60U;
+
+// Largest frame side a record can describe (its rectangle fields are 16 bits wide)
+constexpr auto MAX_RECORDED_SIDE = 0xFFFFU;
+
+// Most bytes deflate can expand one compressed byte into
+constexpr auto MAX_DEFLATE_RATIO = 1032U;
+
+enum class RecordType : uint8_t { Keyframe, Delta };
+
+auto appendLittleEndian(std::vector<unsigned char>& out, uint64_t value, size_t bytes) -> void {
+    for (size_t i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+}
+
+auto readLittleEndian(const unsigned char* data, size_t bytes) -> uint64_t {
+    auto value = uint64_t{0};
+    for (size_t i = bytes; i > 0; --i) {
+        value = (value << 8U) | data[i - 1];
+    }
+    return value;
+}
+
+// Bytes of the pixels of `rect`, without row padding
+auto rectBytes(const FrameFormat& format, const Rect& rect) -> size_t {
+    return size_t{rect.width} * rect.height * format.bytesPerPixel();
+}
+
+/**
+ * Writes a continuous session into a .fbrec recording.
+ *
+ * Frames stay in the frame buffer's own pixel format, so recording costs a copy of the changed
+ * rectangle, an XOR and a fast deflate of mostly zero bytes; conversion and PNG encoding are left
+ * to extraction. Unchanged frames are not stored unless -k is given.
+ */
+class RecordingWriter {
+  public:
+    explicit RecordingWriter(const Options& options) : options(options) {}
+
+    // Add a frame captured at `timeUs`; `dirty` is the part that changed since the last frame
+    auto add(const FrameView& frame, const Rect& dirty, uint64_t timeUs) -> bool {
+        if (not file.isOpen() && not start(frame, timeUs)) {
+            return false;
+        }
+        if (dirty.empty() && not options.keepUnchanged) {
+            return true;
+        }
+
+        const auto& format = frame.format;
+        auto bpp = format.bytesPerPixel();
+        auto keyframe = frames % KEYFRAME_INTERVAL == 0;
+        auto rect = keyframe ? Rect{0, 0, format.width, format.height} : dirty;
+        auto lineBytes = size_t{format.width} * bpp;
+        auto rectLine = size_t{rect.width} * bpp;
 
-// Constants for color conversion (RGB565 to RGB888)
-constexpr auto RED_MAX = 31;
-constexpr auto GREEN_MAX = 63;
-constexpr auto BLUE_MAX = 31;
-constexpr auto COLOR_MAX = 255;
+        // keyframes are stored as they are, deltas as the XOR with the previous frame
+        delta.resize(rectBytes(format, rect));
+        for (auto y = 0U; y < rect.height; ++y) {
+            const auto* src = frame.row(rect.y + y) + size_t{rect.x} * bpp;
+            auto* prev = previous.data() + (rect.y + y) * lineBytes + size_t{rect.x} * bpp;
+            auto* out = delta.data() + y * rectLine;
+            for (size_t i = 0; i < rectLine; ++i) {
+                out[i] = keyframe ? src[i] : static_cast<unsigned char>(src[i] ^ prev[i]);
+            }
+            std::memcpy(prev, src, rectLine);
+        }
 
-struct RGB565 {
-    uint16_t blue : 5;
-    uint16_t green : 6;
-    uint16_t red : 5;
-};
+        record.clear();
+        auto type = keyframe ? RecordType::Keyframe : RecordType::Delta;
+        appendLittleEndian(record, static_cast<uint64_t>(type), 4); // type and 3 reserved bytes
+        appendLittleEndian(record, 0, 4);                            // deflated size, set below
+        appendLittleEndian(record, timeUs - startUs, 8);
+        for (auto value : {rect.x, rect.y, rect.width, rect.height}) {
+            appendLittleEndian(record, value, 2);
+        }
+        deflater.compress(delta.data(), delta.size(), true, record);
+        auto size = record.size() - RECORD_HEADER_SIZE;
+        for (size_t i = 0; i < 4; ++i) {
+            record[4 + i] = static_cast<unsigned char>(size >> (8 * i));
+        }
 
-struct RGB888 {
-    unsigned char red;
-    unsigned char green;
-    unsigned char blue;
+        appendLittleEndian(index, offset, INDEX_ENTRY_SIZE);
+        offset += record.size();
+        ++frames;
+        return file.write(record);
+    }
+
+    // Append the index and trailer and close the file
+    auto finish() -> bool {
+        if (not file.isOpen()) {
+            return true;
+        }
+        auto trailer = std::vector<unsigned char>();
+        appendLittleEndian(trailer, offset, 8);
+        appendLittleEndian(trailer, frames, 8);
+        trailer.insert(trailer.end(), INDEX_MAGIC.begin(), INDEX_MAGIC.end());
+        auto ok = file.write(index) && file.write(trailer);
+
+        if (not file.close(ok, options.sync)) {
+            return false;
+        }
+        std::cout << "Recording saved as " << file.name() << " (" << frames << " frames)\n";
+        return true;
+    }
+
+  private:
+    auto start(const FrameView& frame, uint64_t timeUs) -> bool {
+        auto namer = namerFor(options, ".fbrec", options.nameTemplate);
+        auto fields = NameFields();
+        fields.timestamp = time(nullptr);
+        fields.dirty = Rect{0, 0, frame.format.width, frame.format.height};
+        auto claimed = outputFor(options, namer, fields);
+        if (not claimed || not file.open(std::move(*claimed))) {
+            return false;
+        }
+
+        const auto& format = frame.format;
+        auto header = std::vector<unsigned char>(RECORDING_MAGIC.begin(), RECORDING_MAGIC.end());
+        for (auto value : {format.width, format.height, format.bitsPerPixel}) {
+            appendLittleEndian(header, value, 4);
+        }
+        for (const auto& field : {format.red, format.green, format.blue, format.transp}) {
+            appendLittleEndian(header, field.offset, 1);
+            appendLittleEndian(header, field.length, 1);
+        }
+        appendLittleEndian(header, KEYFRAME_INTERVAL, 4);
+        appendLittleEndian(header, static_cast<uint64_t>(time(nullptr)), 8);
+
+        previous.assign(rectBytes(format, Rect{0, 0, format.width, format.height}), 0);
+        startUs = timeUs;
+        offset = header.size();
+        return file.write(header);
+    }
+
+    const Options& options;
+    SessionFile file;
+    uint64_t startUs = 0;
+    uint64_t offset = 0; // file size so far
+    uint64_t frames = 0;
+    std::vector<unsigned char> previous; // last stored frame, rows without padding
+    std::vector<unsigned char> delta;
+    std::vector<unsigned char> record;
+    std::vector<unsigned char> index;
+    Deflater deflater;
 };
 
-auto getDate() -> std::array<char, DATE_STR_SIZE> {
-    auto now = time(nullptr);
-    auto* ltm = localtime(&now); // NOLINT (ignore thread unsafety)
+static_assert(RECORDING_MAGIC.size() + 3 * 4 + 4 * 2 + 4 + 8 == RECORDING_HEADER_SIZE);
 
-    auto date = std::array<char, DATE_STR_SIZE>();
-    (void)strftime(date.data(), sizeof(date), "%Y-%m-%d-%H-%M-%S", ltm);
-    return date;
-}
+/**
+ * Decode frames `first` to `last` of a recording and save each through a FrameWriter.
+ *
+ * The trailer's index locates every record; a recording that was cut off before its index was
+ * written is indexed by walking the records instead. Decoding starts at the keyframe preceding
+ * `first`.
+ */
+auto extractRecording(const Options& options) -> int {
+    auto fd = UniqueFd(open(options.extractPath.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat info {};
+    if (not fd.valid() || fstat(fd.get(), &info) != 0) {
+        std::cerr << "Failed to open " << options.extractPath << "\n";
+        return 1;
+    }
+    auto fileSize = static_cast<uint64_t>(info.st_size);
+    // sizes and offsets come from the file, so they are checked before anything is allocated
+    auto readAt = [&fd, fileSize](uint64_t offset, uint64_t size, std::vector<unsigned char>& out) {
+        if (size > fileSize || offset > fileSize - size) {
+            return false;
+        }
+        out.resize(static_cast<size_t>(size));
+        return pread(fd.get(), out.data(), out.size(), static_cast<off_t>(offset)) ==
+               static_cast<ssize_t>(size);
+    };
+
+    auto buffer = std::vector<unsigned char>();
+    if (not readAt(0, RECORDING_HEADER_SIZE, buffer) ||
+        not std::equal(RECORDING_MAGIC.begin(), RECORDING_MAGIC.end(), buffer.begin())) {
+        std::cerr << options.extractPath << " is not a frame buffer recording\n";
+        return 1;
+    }
+    auto format = FrameFormat();
+    format.width = static_cast<uint32_t>(readLittleEndian(&buffer[8], 4));
+    format.height = static_cast<uint32_t>(readLittleEndian(&buffer[12], 4));
+    format.bitsPerPixel = static_cast<uint32_t>(readLittleEndian(&buffer[16], 4));
+    format.stride = format.width * format.bytesPerPixel();
+    auto fields = std::array{&format.red, &format.green, &format.blue, &format.transp};
+    for (auto i = 0U; i < fields.size(); ++i) {
+        *fields[i] = fb_bitfield{buffer[20 + 2 * i], buffer[21 + 2 * i], 0};
+    }
+    auto keyframeInterval = readLittleEndian(&buffer[28], 4);
+    auto startTime = static_cast<time_t>(readLittleEndian(&buffer[32], 8));
+
+    // the converters read one pixel into a 32-bit value and shift by the channel offsets, and
+    // every frame is rebuilt from a keyframe that has to fit into the file deflated
+    auto depth = format.bitsPerPixel;
+    auto fieldFits = [depth](const fb_bitfield* field) {
+        return field->length == 0 || field->offset + field->length <= depth;
+    };
+    auto sideFits = [](uint32_t side) { return side != 0 && side <= MAX_RECORDED_SIDE; };
+    auto valid = (depth == 8 || depth == 16 || depth == 24 || depth == 32) &&
+                 std::all_of(fields.begin(), fields.end(), fieldFits) &&
+                 sideFits(format.width) && sideFits(format.height) && keyframeInterval != 0;
+    auto frameBytes = uint64_t{format.width} * format.height * format.bytesPerPixel();
+    if (not valid || frameBytes > fileSize * MAX_DEFLATE_RATIO || frameBytes > SIZE_MAX) {
+        std::cerr << options.extractPath << " has an invalid header\n";
+        return 1;
+    }
+
+    auto offsets = std::vector<uint64_t>();
+    auto indexed = readAt(fileSize - TRAILER_SIZE, TRAILER_SIZE, buffer) &&
+                   std::equal(INDEX_MAGIC.begin(), INDEX_MAGIC.end(), buffer.begin() + 16);
+    if (indexed) {
+        auto indexOffset = readLittleEndian(buffer.data(), 8);
+        auto count = readLittleEndian(&buffer[8], 8);
+        indexed = count <= fileSize / INDEX_ENTRY_SIZE &&
+                  readAt(indexOffset, count * INDEX_ENTRY_SIZE, buffer);
+        for (size_t i = 0; indexed && i < count; ++i) {
+            offsets.push_back(readLittleEndian(&buffer[i * INDEX_ENTRY_SIZE], INDEX_ENTRY_SIZE));
+            indexed = offsets.back() <= fileSize - RECORD_HEADER_SIZE;
+        }
+    }
+    if (not indexed) {
+        offsets.clear();
+        for (auto offset = uint64_t{RECORDING_HEADER_SIZE};
+             readAt(offset, RECORD_HEADER_SIZE, buffer);) {
+            auto next = offset + RECORD_HEADER_SIZE + readLittleEndian(&buffer[4], 4);
+            if (next > fileSize) {
+                break;
+            }
+            offsets.push_back(offset);
+            offset = next;
+        }
+    }
+
+    auto last = std::min(options.lastFrame, uint64_t{offsets.size()});
+    if (options.firstFrame >= last) {
+        std::cerr << "No frames to extract\n";
+        return 1;
+    }
+
+    auto full = Rect{0, 0, format.width, format.height};
+    auto pixels = std::vector<unsigned char>(rectBytes(format, full));
+    auto delta = std::vector<unsigned char>();
+    auto inflater = Inflater();
+    auto writer = FrameWriter(options);
+    auto lineBytes = size_t{format.stride};
+    auto bpp = format.bytesPerPixel();
+    for (auto i = options.firstFrame / keyframeInterval * keyframeInterval; i < last; ++i) {
+        if (not readAt(offsets[i], RECORD_HEADER_SIZE, buffer)) {
+            std::cerr << "Frame " << i << " is truncated\n";
+            return 1;
+        }
+        auto type = static_cast<RecordType>(buffer[0]);
+        auto size = readLittleEndian(&buffer[4], 4);
+        auto timestampUs = readLittleEndian(&buffer[8], 8);
+        auto field = [&buffer](size_t offset) {
+            return static_cast<uint32_t>(readLittleEndian(&buffer[offset], 2));
+        };
+        auto rect = Rect{field(16), field(18), field(20), field(22)};
+        if (rect.x + rect.width > format.width || rect.y + rect.height > format.height ||
+            (type == RecordType::Keyframe) != (i % keyframeInterval == 0) ||
+            not readAt(offsets[i] + RECORD_HEADER_SIZE, size, buffer)) {
+            std::cerr << "Frame " << i << " is corrupt\n";
+            return 1;
+        }
+
+        delta.resize(rectBytes(format, rect));
+        if (not inflater.inflate(buffer.data(), buffer.size(), delta.data(), delta.size())) {
+            std::cerr << "Frame " << i << " is corrupt\n";
+            return 1;
+        }
+        auto rectLine = size_t{rect.width} * bpp;
+        for (auto y = 0U; y < rect.height; ++y) {
+            auto* out = pixels.data() + (rect.y + y) * lineBytes + size_t{rect.x} * bpp;
+            const auto* in = delta.data() + y * rectLine;
+            for (size_t x = 0; x < rectLine; ++x) {
+                out[x] = type == RecordType::Keyframe ? in[x]
+                                                      : static_cast<unsigned char>(out[x] ^ in[x]);
+            }
+        }
 
-auto fileExists(const char* path) -> bool {
-    struct stat buffer {};
-    return (stat(path, &buffer) == 0);
+        if (i >= options.firstFrame) {
+            auto frame = FrameView{pixels.data(), format};
+            auto timestamp = startTime + static_cast<time_t>(timestampUs / 1'000'000);
+            if (not writer.save(frame, rect, timestamp, i)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
 }
 
-auto generateFileName(std::string_view directory, std::string_view baseName, bool includeDate)
-    -> std::string {
-    auto dateStr = includeDate ? getDate() : std::array<char, DATE_STR_SIZE>();
+/**
+ * Flight recorder keeping the most recent frames in memory, in the frame buffer's own format.
+ *
+ * The ring holds a fixed number of frames. Tiles that did not change since the previous frame are
+ * shared with it and unchanged frames share the whole previous record, so a mostly static UI
+ * costs little more than a single frame. Conversion and PNG encoding only happen on dump().
+ */
+class FlightRecorder {
+  public:
+    explicit FlightRecorder(size_t capacity) : ring(capacity) {}
+
+    // Store the frame; tiles the tracker did not see change are shared with the previous frame
+    auto record(
+        const FrameView& frame,
+        const Rect& dirty,
+        const DirtyTracker& tracker,
+        time_t timestamp,
+        uint64_t index
+    ) -> void {
+        const auto& format = frame.format;
+        auto previous = newest();
+        auto reusable = previous != nullptr && previous->format.width == format.width &&
+                        previous->format.height == format.height &&
+                        previous->format.bitsPerPixel == format.bitsPerPixel;
+        auto changed = not reusable || not dirty.empty();
+
+        auto tiles = std::vector<std::shared_ptr<const Tile>>();
+        if (changed) {
+            auto tilesX = tileCount(format.width);
+            auto tilesY = tileCount(format.height);
+            tiles.reserve(static_cast<size_t>(tilesX) * tilesY);
+            for (auto ty = 0U; ty < tilesY; ++ty) {
+                for (auto tx = 0U; tx < tilesX; ++tx) {
+                    auto tileIndex = tiles.size();
+                    if (reusable && not tracker.tileChanged(tileIndex)) {
+                        tiles.push_back(previous->tiles[tileIndex]);
+                    } else {
+                        tiles.push_back(copyTile(frame, tileBounds(format, tx, ty)));
+                    }
+                }
+            }
+        }
+
+        auto& slot = ring[next];
+        if (changed) {
+            auto stored = std::make_shared<Frame>();
+            stored->format = format;
+            stored->format.stride = format.width * format.bytesPerPixel();
+            stored->tiles = std::move(tiles);
+            slot.frame = std::move(stored);
+        } else {
+            slot.frame = previous;
+        }
+        slot.timestamp = timestamp;
+        slot.index = index;
+
+        next = (next + 1) % ring.size();
+        size = std::min(size + 1, ring.size());
+    }
 
-    // calculate the required size for the file path string
-    auto reqSize = (directory.empty() ? 0 : directory.size() + 1) // +1 for the '/'
-                   + baseName.size() + 1                          // +1 for the '-'
-                   + dateStr.size() + 4;                          // +4 for ".png"
+    // Write the recorded frames oldest first and empty the ring; returns the number written
+    auto dump(FrameWriter& writer) -> size_t {
+        auto raw = std::vector<unsigned char>();
+        auto written = size_t{0};
 
-    auto filePath = std::string();
-    filePath.reserve(reqSize);
+        for (auto i = size_t{0}; i < size; ++i) {
+            auto& slot = ring[(next + ring.size() - size + i) % ring.size()];
+            auto frame = assemble(*slot.frame, raw);
+            auto full = Rect{0, 0, frame.format.width, frame.format.height};
+            if (writer.save(frame, full, slot.timestamp, slot.index)) {
+                ++written;
+            }
+            slot.frame.reset();
+        }
 
-    // construct the initial file path
-    if (!directory.empty()) {
-        filePath.append(directory);
-        filePath.append("/");
+        size = 0;
+        return written;
     }
-    filePath.append(baseName);
-    if (includeDate) {
-        filePath.append("-");
-        filePath.append(dateStr.data());
+
+  private:
+    // Pixel rows of one tile, packed without padding
+    using Tile = std::vector<unsigned char>;
+
+    struct Frame {
+        FrameFormat format;
+        std::vector<std::shared_ptr<const Tile>> tiles;
+    };
+
+    struct Slot {
+        std::shared_ptr<const Frame> frame;
+        time_t timestamp = 0;
+        uint64_t index = 0;
+    };
+
+    static auto copyTile(const FrameView& frame, const Rect& bounds)
+        -> std::shared_ptr<const Tile> {
+        auto bpp = frame.format.bytesPerPixel();
+        auto rowSize = static_cast<size_t>(bounds.width) * bpp;
+        auto tile = std::make_shared<Tile>(rowSize * bounds.height);
+        for (auto row = 0U; row < bounds.height; ++row) {
+            const auto* src = frame.row(bounds.y + row) + static_cast<size_t>(bounds.x) * bpp;
+            std::memcpy(&(*tile)[row * rowSize], src, rowSize);
+        }
+        return tile;
     }
-    filePath.append(".png");
 
-    // size of the base file path (without ".png")
-    auto basePathSize = filePath.size() - 4;
-    auto counterStr = std::array<char, COUNTER_STR_SIZE>();
-    auto counter = 1;
+    // Stitch the tiles of a recorded frame back into one contiguous image
+    static auto assemble(const Frame& frame, std::vector<unsigned char>& pixels) -> FrameView {
+        const auto& format = frame.format;
+        pixels.resize(static_cast<size_t>(format.stride) * format.height);
 
-    // Loop to ensure unique file name
-    while (fileExists(filePath.c_str())) {
-        // convert the counter number into a string
-        auto [endPtr, ec] = std::to_chars(counterStr.begin(), counterStr.end(), counter);
-        if (ec != std::errc()) {
-            throw std::runtime_error("Failed to convert number to string");
+        auto bpp = format.bytesPerPixel();
+        auto tilesX = tileCount(format.width);
+        for (auto index = size_t{0}; index < frame.tiles.size(); ++index) {
+            auto tx = static_cast<uint32_t>(index % tilesX);
+            auto ty = static_cast<uint32_t>(index / tilesX);
+            auto bounds = tileBounds(format, tx, ty);
+            auto rowSize = static_cast<size_t>(bounds.width) * bpp;
+            const auto& tile = *frame.tiles[index];
+            for (auto row = 0U; row < bounds.height; ++row) {
+                auto offset = static_cast<size_t>(bounds.y + row) * format.stride +
+                              static_cast<size_t>(bounds.x) * bpp;
+                std::memcpy(&pixels[offset], &tile[row * rowSize], rowSize);
+            }
         }
-        // strip the counter number and the suffix
-        filePath.resize(basePathSize);
+        return FrameView{pixels.data(), format};
+    }
 
-        // append the new counter & suffix
-        filePath.append("-");
-        filePath.append(counterStr.begin(), endPtr);
-        filePath.append(".png");
-        ++counter;
+    [[nodiscard]] auto newest() const -> std::shared_ptr<const Frame> {
+        return size == 0 ? nullptr : ring[(next + ring.size() - 1) % ring.size()].frame;
     }
 
-    return filePath;
-}
+    std::vector<Slot> ring;
+    size_t next = 0;
+    size_t size = 0;
+};
 
-auto convertRgb565ToRgb888(const std::vector<RGB565>& buffer565) -> std::vector<RGB888> {
-    auto buffer888 = std::vector<RGB888>(WIDTH * HEIGHT);
-    for (size_t i = 0; i < WIDTH * HEIGHT; ++i) {
-        buffer888[i].red = buffer565[i].red * COLOR_MAX / RED_MAX;
-        buffer888[i].green = buffer565[i].green * COLOR_MAX / GREEN_MAX;
-        buffer888[i].blue = buffer565[i].blue * COLOR_MAX / BLUE_MAX;
+// Datagram socket accepting flight recorder commands ("dump")
+auto openControlSocket(const std::string& path) -> UniqueFd {
+    auto address = sockaddr_un{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Control socket path is too long\n";
+        return UniqueFd();
     }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
 
-    return buffer888;
+    auto sock = UniqueFd(socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0));
+    // a stale socket of a previous session of this user; anything else at the path stays
+    struct stat info {};
+    if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode) && info.st_uid == getuid()) {
+        (void)unlink(path.c_str());
+    }
+    auto* addr = reinterpret_cast<sockaddr*>(&address); // NOLINT (reinterpret_cast)
+    if (not sock.valid() || bind(sock.get(), addr, sizeof(address)) != 0) {
+        std::cerr << "Failed to open control socket " << path << "\n";
+        return UniqueFd();
+    }
+    return sock;
 }
 
-// NOLINTBEGIN: libpng is a C library requiring some "unsafe" constructs
-auto writePng(const char* filename, const std::vector<RGB888>& buffer) -> void {
-    FILE* fp = fopen(filename, "wb");
-    if (fp == nullptr) {
-        std::cerr << "Failed to open file for writing\n";
-        return;
+/**
+ * Bounded single-producer single-consumer ring of preallocated slots.
+ *
+ * The producer fills back() and publishes it with push(); the consumer reads front() and hands
+ * the slot back with pop(). Neither side takes a lock: the two indices are atomics, each written
+ * by one side only. Slots are reused, so their buffers keep their capacity.
+ */
+template <typename T> class SpscRing {
+  public:
+    explicit SpscRing(size_t capacity) : slots(capacity) {}
+
+    // Producer side
+    [[nodiscard]] auto full() const -> bool {
+        return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) ==
+               slots.size();
+    }
+    auto back() -> T& { return slots[tail.load(std::memory_order_relaxed) % slots.size()]; }
+    auto push() -> void {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
     }
 
-    auto* png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-    if (png == nullptr) {
-        std::cerr << "Failed to create PNG write struct\n";
-        fclose(fp);
-        return;
+    // Consumer side
+    [[nodiscard]] auto empty() const -> bool {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+    auto front() -> T& { return slots[head.load(std::memory_order_relaxed) % slots.size()]; }
+    auto pop() -> void {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
     }
 
-    auto* info = png_create_info_struct(png);
-    if (info == nullptr) {
-        std::cerr << "Failed to create PNG info struct\n";
-        png_destroy_write_struct(&png, nullptr);
-        fclose(fp);
-        return;
+  private:
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head{0}; // next slot to consume
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to fill
+};
+
+// A captured frame on its way to the encoder
+struct CapturedFrame {
+    std::vector<unsigned char> pixels;
+    FrameFormat format;
+    Rect dirty;
+    time_t timestamp = 0;
+    uint64_t capturedUs = 0;
+    uint64_t index = 0;
+
+    [[nodiscard]] auto view() const -> FrameView { return FrameView{pixels.data(), format}; }
+};
+
+/**
+ * Converts, encodes and hands frames to the write queue on a thread of its own, so capture only
+ * copies the frame and the session runs at the rate of its slowest stage instead of the sum of
+ * all of them.
+ *
+ * Frames are copied into the slots of an SpscRing. The locks below only put an idle side to
+ * sleep; frames themselves pass without one. Without a thread, push() encodes right away.
+ */
+class EncodeStage {
+  public:
+    using Consumer = std::function<bool(const CapturedFrame&)>;
+
+    EncodeStage(size_t depth, Consumer consume) : ring(depth), consume(std::move(consume)) {
+        try {
+            worker = std::thread([this] { work(); });
+        } catch (const std::system_error&) {
+            // no thread: push() runs the consumer itself
+        }
     }
+    EncodeStage(const EncodeStage&) = delete;
+    auto operator=(const EncodeStage&) -> EncodeStage& = delete;
+    ~EncodeStage() { finish(); }
 
-    if (setjmp(png_jmpbuf(png))) {
-        std::cerr << "Failed to set PNG jump buffer\n";
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        return;
+    /**
+     * Copy a frame into a free slot and pass it on. With `wait` a full ring blocks until the
+     * encoder frees a slot; without it the frame is not taken and false is returned.
+     */
+    auto push(
+        const FrameView& frame,
+        const Rect& dirty,
+        time_t timestamp,
+        uint64_t capturedUs,
+        uint64_t index,
+        bool wait
+    ) -> bool {
+        if (ring.full()) {
+            if (not wait) {
+                return false;
+            }
+            auto lock = std::unique_lock(mutex);
+            released.wait(lock, [this] { return not ring.full() || failed(); });
+        }
+        if (failed()) {
+            return true; // dropped; the capture loop stops on failed()
+        }
+
+        auto& slot = ring.back();
+        slot.format = frame.format;
+        auto size = size_t{frame.format.stride} * frame.format.height;
+        slot.pixels.assign(frame.pixels, frame.pixels + size);
+        slot.dirty = dirty;
+        slot.timestamp = timestamp;
+        slot.capturedUs = capturedUs;
+        slot.index = index;
+
+        if (not worker.joinable()) {
+            error.store(not consume(slot), std::memory_order_release);
+            return true;
+        }
+        ring.push();
+        wake(filled);
+        return true;
     }
 
-    png_init_io(png, fp);
+    // Whether encoding or writing a frame failed
+    [[nodiscard]] auto failed() const -> bool { return error.load(std::memory_order_acquire); }
 
-    png_set_IHDR(
-        png,
-        info,
-        WIDTH,
-        HEIGHT,
-        8, // bit depth;
-        PNG_COLOR_TYPE_RGB,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT
-    );
+    // Encode the frames still queued and stop the thread; false if any frame failed
+    auto finish() -> bool {
+        if (worker.joinable()) {
+            {
+                auto lock = std::lock_guard(mutex);
+                stopping = true;
+            }
+            filled.notify_one();
+            worker.join();
+        }
+        return not failed();
+    }
 
-    png_write_info(png, info);
+  private:
+    // Taking the lock orders the notification after the other side's check before sleeping
+    auto wake(std::condition_variable& condition) -> void {
+        {
+            auto lock = std::lock_guard(mutex);
+        }
+        condition.notify_one();
+    }
 
-    for (auto y = 0U; y < HEIGHT; ++y) {
-        png_write_row(png, reinterpret_cast<const unsigned char*>(&buffer[y * WIDTH]));
+    auto work() -> void {
+        while (true) {
+            if (ring.empty()) {
+                auto lock = std::unique_lock(mutex);
+                filled.wait(lock, [this] { return stopping || not ring.empty(); });
+                if (ring.empty()) {
+                    return;
+                }
+            }
+            // after a failure the remaining frames are only released
+            if (not failed() && not consume(ring.front())) {
+                error.store(true, std::memory_order_release);
+            }
+            ring.pop();
+            wake(released);
+        }
     }
 
-    png_write_end(png, nullptr);
-    png_destroy_write_struct(&png, &info);
-    fclose(fp);
+    SpscRing<CapturedFrame> ring;
+    Consumer consume;
+    std::atomic<bool> error{false};
+    std::thread worker;
+    std::mutex mutex; // only for sleeping on an empty or full ring
+    std::condition_variable filled;
+    std::condition_variable released;
+    bool stopping = false;
+};
+
+/**
+ * Capture frames on a fixed CLOCK_MONOTONIC schedule until the count is reached or SIGINT/SIGTERM
+ * arrives.
+ *
+ * The timer is armed with absolute expirations, so a slow frame does not push back the following
+ * ones; ticks that pass while a frame is still being written are skipped and reported. Frames
+ * identical to the previous one are not saved unless requested. In flight
+ * recorder mode frames only go into the in-memory ring, which is written out on SIGUSR1, on a
+ * "dump" command on the control socket and on exit. Otherwise this thread only captures: frames
+ * are encoded by an EncodeStage and written through a WriteQueue, so capture, encoding and
+ * writing overlap. When the encoder falls behind, capture either waits for it or drops frames,
+ * as the queue policy says.
+ */
+auto runContinuous(FrameBuffer& frameBuf, const Options& options) -> int {
+    auto signals = sigset_t{};
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &signals, nullptr) != 0) {
+        std::cerr << "Failed to block signals\n";
+        return 1;
+    }
+
+    auto signalFd = UniqueFd(signalfd(-1, &signals, SFD_CLOEXEC));
+    auto timerFd = UniqueFd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC));
+    if (not signalFd.valid() || not timerFd.valid()) {
+        std::cerr << "Failed to set up capture timer\n";
+        return 1;
+    }
+
+    auto controlFd = UniqueFd();
+    if (not options.controlSocket.empty()) {
+        controlFd = openControlSocket(options.controlSocket);
+        if (not controlFd.valid()) {
+            return 1;
+        }
+    }
+
+    auto recorder = std::unique_ptr<FlightRecorder>();
+    if (options.recorderSeconds != 0) {
+        auto capacity = (uint64_t{options.recorderSeconds} * 1000 + options.intervalMs - 1) /
+                        options.intervalMs;
+        recorder = std::make_unique<FlightRecorder>(static_cast<size_t>(capacity));
+    }
+
+    auto start = timespec{};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    auto schedule = itimerspec{};
+    schedule.it_value = start;
+    schedule.it_interval.tv_sec = static_cast<time_t>(options.intervalMs / 1000);
+    schedule.it_interval.tv_nsec = static_cast<long>(options.intervalMs % 1000) * 1'000'000L;
+    if (timerfd_settime(timerFd.get(), TFD_TIMER_ABSTIME, &schedule, nullptr) != 0) {
+        std::cerr << "Failed to start capture timer\n";
+        return 1;
+    }
+
+    auto tracker = DirtyTracker();
+    auto retention = Retention(options.maxBytes, options.maxFiles);
+    auto queue = WriteQueue(options.sync, retention);
+    auto writer = FrameWriter(options, &queue, &retention);
+    auto animation = std::unique_ptr<AnimationWriter>();
+    if (options.animate) {
+        animation = std::make_unique<AnimationWriter>(options);
+    }
+    auto recording = std::unique_ptr<RecordingWriter>();
+    if (options.record) {
+        recording = std::make_unique<RecordingWriter>(options);
+    }
+    // flight recorder frames stay on this thread, they are only encoded on a dump
+    auto stage = std::unique_ptr<EncodeStage>();
+    if (recorder == nullptr) {
+        stage = std::make_unique<EncodeStage>(
+            options.queueDepth,
+            [&](const CapturedFrame& captured) {
+                auto frame = captured.view();
+                if (recording != nullptr) {
+                    return recording->add(frame, captured.dirty, captured.capturedUs);
+                }
+                if (animation != nullptr) {
+                    return animation->add(frame, captured.dirty, captured.capturedUs / 1000);
+                }
+                return writer.save(frame, captured.dirty, captured.timestamp, captured.index);
+            }
+        );
+    }
+    auto fds = std::array{
+        pollfd{timerFd.get(), POLLIN, 0},
+        pollfd{signalFd.get(), POLLIN, 0},
+        pollfd{controlFd.get(), POLLIN, 0}, // ignored by poll() when there is no socket
+    };
+    auto frames = uint64_t{0};
+    auto skipped = uint64_t{0};
+    auto unchanged = uint64_t{0};
+    auto dropped = uint64_t{0};
+    auto carried = Rect(); // changes of dropped frames, for the next frame passed on
+    auto failed = false;
+    auto stop = false;
+
+    while (not stop && (options.count == 0 || frames < options.count)) {
+        if (stage != nullptr && stage->failed()) {
+            failed = true;
+            break;
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to wait for the capture timer\n";
+            failed = true;
+            break;
+        }
+
+        if ((fds[1].revents & POLLIN) != 0) {
+            auto info = signalfd_siginfo{};
+            if (read(signalFd.get(), &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGUSR1 && recorder != nullptr) {
+                    recorder->dump(writer);
+                } else if (info.ssi_signo != SIGUSR1) {
+                    stop = true;
+                }
+            }
+            continue;
+        }
+
+        if ((fds[2].revents & POLLIN) != 0) {
+            auto command = std::array<char, COMMAND_STR_SIZE>();
+            auto length = recv(controlFd.get(), command.data(), command.size(), 0);
+            auto size = static_cast<size_t>(std::max<ssize_t>(length, 0));
+            auto text = std::string_view(command.data(), size);
+            if (text.substr(0, 4) == "dump" && recorder != nullptr) {
+                recorder->dump(writer);
+            }
+        }
+
+        if ((fds[0].revents & POLLIN) == 0) {
+            continue;
+        }
+
+        auto expirations = uint64_t{0};
+        if (read(timerFd.get(), &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            continue;
+        }
+        skipped += expirations - 1;
+
+        auto frame = options.tearFree ? frameBuf.snapshot() : frameBuf.view();
+        auto captured = monotonicUs();
+        auto dirty = tracker.update(frame);
+        ++frames;
+
+        if (recorder != nullptr) {
+            recorder->record(frame, dirty, tracker, time(nullptr), frames - 1);
+            continue;
+        }
+
+        // unchanged frames only extend the delay of the previous one in an animation, which the
+        // writers take from the timestamps, so they are not worth a copy into the queue
+        dirty = unite(dirty, carried);
+        auto keep = options.keepUnchanged && animation == nullptr;
+        if (dirty.empty() && (animation != nullptr || recording != nullptr || not keep)) {
+            ++unchanged;
+        }
+        if (dirty.empty() && not keep) {
+            continue;
+        }
+        auto wait = options.queuePolicy == QueuePolicy::Block;
+        if (stage->push(frame, dirty, time(nullptr), captured, frames - 1, wait)) {
+            carried = Rect();
+        } else {
+            carried = dirty;
+            ++dropped;
+        }
+    }
+
+    if (stage != nullptr && not stage->finish()) {
+        failed = true;
+    }
+    if (recorder != nullptr) {
+        recorder->dump(writer);
+    }
+    if (not queue.drain()) {
+        failed = true;
+    }
+    if (animation != nullptr && not animation->finish()) {
+        failed = true;
+    }
+    if (recording != nullptr && not recording->finish()) {
+        failed = true;
+    }
+    if (controlFd.valid()) {
+        (void)unlink(options.controlSocket.c_str());
+    }
+
+    std::cout << "Captured " << frames << " frames";
+    if (unchanged != 0) {
+        std::cout << ", " << unchanged << " unchanged";
+    }
+    if (dropped != 0) {
+        std::cout << ", " << dropped << " dropped";
+    }
+    if (skipped != 0) {
+        std::cout << " (" << skipped << " ticks skipped)";
+    }
+    std::cout << "\n";
+    return failed ? 1 : 0;
+}
+
+/**
+ * Micro-benchmark of the RGB565 to RGB888 kernels.
+ *
+ * Converts a TXT-sized frame of pseudo-random pixels (nothing for a data dependent path to
+ * exploit) with every kernel this CPU supports and checks each result against the reference
+ * formula.
+ */
+auto runBenchmark() -> int {
+    constexpr auto iterations = 1000;
+
+    auto pixels = std::vector<RGB565>(static_cast<size_t>(WIDTH) * HEIGHT);
+    auto state = uint32_t{1};
+    for (auto& pixel : pixels) {
+        state = state * 1664525U + 1013904223U;
+        auto value = static_cast<uint16_t>(state >> 16U);
+        std::memcpy(&pixel, &value, sizeof(pixel));
+    }
+
+    auto reference = std::vector<RGB888>(pixels.size());
+    convertRgb565ToRgb888Reference(pixels.data(), reference.data(), pixels.size());
+
+    auto kernels = std::vector<Rgb565Kernel>{{"reference", convertRgb565ToRgb888Reference}};
+    kernels.insert(kernels.end(), rgb565Kernels().begin(), rgb565Kernels().end());
+
+    std::cout << "RGB565 to RGB888, " << WIDTH << "x" << HEIGHT << " frame, " << iterations
+              << " iterations\n";
+    auto failed = false;
+    for (const auto& kernel : kernels) {
+        auto output = std::vector<RGB888>(pixels.size());
+        auto start = std::chrono::steady_clock::now();
+        for (auto i = 0; i < iterations; ++i) {
+            kernel.convert(pixels.data(), output.data(), pixels.size());
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        auto micros = std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+        auto exact = std::memcmp(output.data(), reference.data(), output.size() * 3) == 0;
+        failed |= not exact;
+
+        std::cout << "  " << std::left << std::setw(10) << kernel.name << std::right
+                  << std::fixed << std::setprecision(1) << std::setw(8) << micros
+                  << " us/frame" << (exact ? "" : "  MISMATCH") << "\n";
+    }
+    return failed ? 1 : 0;
+}
+
+// Give up the root privileges of a setuid install for good
+auto dropPrivileges() -> bool {
+    auto uid = getuid();
+    auto gid = getgid();
+    if (setresgid(gid, gid, gid) != 0 || setresuid(uid, uid, uid) != 0) {
+        std::cerr << "Failed to drop privileges: " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
 }
-// NOLINTEND
 
 auto main(int argc, char* argv[]) -> int {
-    auto baseName = std::string("screenshot");
-    auto directory = std::string();
-    auto outputFile = std::string();
-    auto includeDate = true;
+    auto opts = Options();
+    auto runBench = false;
     auto showHelp = false;
 
     auto options = std::array{
         option{"name", required_argument, 0, 'n'},
         option{"directory", required_argument, 0, 'd'},
         option{"no-date", no_argument, 0, 'x'},
+        option{"template", required_argument, 0, 'T'},
+        option{"framebuffer", required_argument, 0, 'f'},
+        option{"tear-free", no_argument, 0, 't'},
+        option{"color", required_argument, 0, 'C'},
+        option{"no-palette", no_argument, 0, 'P'},
+        option{"profile", required_argument, 0, 'z'},
+        option{"encoder", required_argument, 0, 'e'},
+        option{"format", required_argument, 0, 'F'},
+        option{"animate", no_argument, 0, 'a'},
+        option{"record", no_argument, 0, 'R'},
+        option{"extract", required_argument, 0, 'X'},
+        option{"frames", required_argument, 0, 'm'},
+        option{"output", required_argument, 0, 'o'},
+        option{"fd", required_argument, 0, 'D'},
+        option{"sync", required_argument, 0, 'S'},
+        option{"interval", required_argument, 0, 'i'},
+        option{"count", required_argument, 0, 'c'},
+        option{"keep-unchanged", no_argument, 0, 'k'},
+        option{"max-bytes", required_argument, 0, 'B'},
+        option{"max-files", required_argument, 0, 'L'},
+        option{"queue-depth", required_argument, 0, 'q'},
+        option{"queue-policy", required_argument, 0, 'Q'},
+        option{"flight-recorder", required_argument, 0, 'r'},
+        option{"control-socket", required_argument, 0, 's'},
+        option{"benchmark", no_argument, 0, 'b'},
         option{"help", no_argument, 0, 'h'},
         option{0, 0, 0, 0}
     };
 
+    const auto* shortOptions = "n:d:xT:f:tC:Pz:e:F:aRX:m:o:D:S:i:c:kB:L:q:Q:r:s:bh";
     auto optIndex = 0;
     auto shortOpt = 0;
 
     // NOLINTNEXTLINE (ignore getopt_long's thread unsafety)
-    while ((shortOpt = getopt_long(argc, argv, "n:d:xh", options.data(), &optIndex)) != -1) {
+    while ((shortOpt = getopt_long(argc, argv, shortOptions, options.data(), &optIndex)) != -1) {
         switch (shortOpt) {
         case 'n':
-            baseName = optarg;
+            opts.baseName = optarg;
             break;
         case 'd':
-            directory = optarg;
+            opts.directory = optarg;
             break;
         case 'x':
-            includeDate = false;
+            opts.includeDate = false;
+            break;
+        case 'T':
+            opts.nameTemplate = NameTemplate::parse(optarg);
+            showHelp |= not opts.nameTemplate;
+            break;
+        case 'f':
+            opts.frameBufPath = optarg;
+            break;
+        case 't':
+            opts.tearFree = true;
+            break;
+        case 'C':
+            if (auto color = parseColor(optarg)) {
+                opts.color = *color;
+            } else {
+                showHelp = true;
+            }
+            break;
+        case 'P':
+            opts.palette = false;
+            break;
+        case 'z':
+            if (auto profile = parseProfile(optarg)) {
+                opts.profile = *profile;
+            } else {
+                showHelp = true;
+            }
+            break;
+        case 'e':
+            if (auto encoder = parseEncoder(optarg)) {
+                opts.encoder = *encoder;
+            } else {
+                showHelp = true;
+            }
+            break;
+        case 'F':
+            if (auto format = parseFormat(optarg)) {
+                opts.format = *format;
+            } else {
+                showHelp = true;
+            }
+            break;
+        case 'a':
+            opts.continuous = true;
+            opts.animate = true;
+            break;
+        case 'R':
+            opts.continuous = true;
+            opts.record = true;
+            break;
+        case 'X':
+            opts.extractPath = optarg;
+            break;
+        case 'm':
+            showHelp |= not parseRange(optarg, opts.firstFrame, opts.lastFrame);
+            break;
+        case 'o':
+            if (std::string_view(optarg) == "-") {
+                opts.outputFd = STDOUT_FILENO;
+            } else {
+                opts.outputPath = optarg;
+            }
+            break;
+        case 'D':
+            showHelp |= not parseNumber(optarg, opts.outputFd) || opts.outputFd < 0;
+            break;
+        case 'S':
+            if (auto sync = parseSync(optarg)) {
+                opts.sync = *sync;
+            } else {
+                showHelp = true;
+            }
+            break;
+        case 'i':
+            opts.continuous = true;
+            showHelp |= not parseNumber(optarg, opts.intervalMs) || opts.intervalMs == 0;
+            break;
+        case 'c':
+            opts.continuous = true;
+            showHelp |= not parseNumber(optarg, opts.count);
+            break;
+        case 'k':
+            opts.keepUnchanged = true;
+            break;
+        case 'B':
+            showHelp |= not parseSize(optarg, opts.maxBytes) || opts.maxBytes == 0;
+            break;
+        case 'L':
+            showHelp |= not parseNumber(optarg, opts.maxFiles) || opts.maxFiles == 0;
+            break;
+        case 'q':
+            showHelp |= not parseNumber(optarg, opts.queueDepth) || opts.queueDepth == 0;
+            break;
+        case 'Q':
+            if (auto policy = parseQueuePolicy(optarg)) {
+                opts.queuePolicy = *policy;
+            } else {
+                showHelp = true;
+            }
+            break;
+        case 'r':
+            opts.continuous = true;
+            showHelp |= not parseNumber(optarg, opts.recorderSeconds) || opts.recorderSeconds == 0;
+            break;
+        case 's':
+            opts.controlSocket = optarg;
+            break;
+        case 'b':
+            runBench = true;
             break;
         case 'h':
         default:
@@ -236,6 +5288,21 @@ auto main(int argc, char* argv[]) -> int {
         }
     }
 
+    // each of these decides where the frames of a session go, so only one can be given
+    auto modes = std::array{
+        opts.animate, opts.record, opts.recorderSeconds != 0, not opts.extractPath.empty()
+    };
+    if (std::count(modes.begin(), modes.end(), true) > 1) {
+        std::cerr << "Only one of --animate, --record, --flight-recorder and --extract can be "
+                     "given\n";
+        showHelp = true;
+    }
+    // an animation is always written as a PNG
+    if (opts.animate && opts.format != FileFormat::Png) {
+        std::cerr << "--animate only writes PNG\n";
+        showHelp = true;
+    }
+
     if (showHelp) {
         std::cout << "Usage: " << argv << " [options]\n"
                   << "Options:\n"
@@ -244,31 +5311,100 @@ auto main(int argc, char* argv[]) -> int {
                   << "  -d, --directory Directory to save the screenshot (default: "
                      "current directory)\n"
                   << "  -x, --no-date   Do not include the date in the filename\n"
+                  << "  -T, --template  File names from a template of strftime fields and\n"
+                  << "                  {seq}, {frame}, {width}, {height}, {x}, {y} or {hash1}..\n"
+                  << "                  {hash8}, e.g. shots/%Y%m%d/{seq:06}-{hash8}.png; used for\n"
+                  << "                  screenshots, flight recorder dumps, extracted frames,\n"
+                  << "                  animations and recordings (whose {hash} is 00000000)\n"
+                  << "  -f, --framebuffer\n"
+                  << "                  Frame buffer device or raw dump to capture (default: "
+                  << FRAME_BUF_PATH << ")\n"
+                  << "  -t, --tear-free Copy the frame right after vsync (or until two reads "
+                     "match)\n"
+                  << "  -C, --color     PNG color type: rgb, rgba or gray (default: rgb)\n"
+                  << "  -P, --no-palette\n"
+                  << "                  Always write truecolor, even if the frame has at most "
+                  << MAX_PALETTE_SIZE << " colors\n"
+                  << "  -z, --profile   Compression profile: fastest, balanced, smallest or auto\n"
+                  << "                  (default: balanced)\n"
+                  << "  -e, --encoder   PNG encoder: libpng or fast (built-in, faster but larger "
+                     "files)\n"
+                  << "                  (default: libpng)\n"
+                  << "  -F, --format    Output format: png, ppm, bmp, raw565 (frame buffer bytes "
+                     "as\n"
+                  << "                  they are) or qoi (default: png)\n"
+                  << "  -a, --animate   Record the continuous capture into one animated PNG\n"
+                  << "  -R, --record    Record the continuous capture into one .fbrec file\n"
+                  << "  -X, --extract   Save the frames of a .fbrec recording in the output "
+                     "format\n"
+                  << "  -m, --frames    Frames to extract: <n> or <first>-<last> (default: all)\n"
+                  << "  -o, --output    Write to this file instead of a generated name; \"-\" "
+                     "writes\n"
+                  << "                  to standard output\n"
+                  << "  -D, --fd        Write to this open file descriptor, e.g. a pipe or "
+                     "socket\n"
+                  << "  -S, --sync      Durability of saved files: none, data (contents synced\n"
+                  << "                  before the rename) or full (and their directory)\n"
+                  << "                  (default: none)\n"
+                  << "  -i, --interval  Capture continuously every <ms> milliseconds (default: "
+                  << DEFAULT_INTERVAL_MS << ")\n"
+                  << "  -c, --count     Stop continuous capture after <n> frames (default: "
+                     "until SIGINT)\n"
+                  << "  -k, --keep-unchanged\n"
+                  << "                  Also save frames identical to the previous one\n"
+                  << "  -B, --max-bytes Delete the oldest files of the session once they take\n"
+                  << "                  more than <n>[K|M|G] bytes\n"
+                  << "  -L, --max-files Delete the oldest files of the session beyond <n> files\n"
+                  << "  -q, --queue-depth\n"
+                  << "                  Captured frames waiting to be encoded (default: "
+                  << DEFAULT_QUEUE_DEPTH << ")\n"
+                  << "  -Q, --queue-policy\n"
+                  << "                  When they are all taken: block (wait for the encoder) or\n"
+                  << "                  drop (skip the new frame) (default: block)\n"
+                  << "  -r, --flight-recorder\n"
+                  << "                  Keep the last <s> seconds of frames in memory and save "
+                     "them\n"
+                  << "                  on SIGUSR1, on exit or on a \"dump\" command\n"
+                  << "  -s, --control-socket\n"
+                  << "                  Unix datagram socket accepting flight recorder "
+                     "commands\n"
+                  << "  -b, --benchmark Time the pixel conversion kernels and exit\n"
                   << "  -h, --help      Show this help message\n";
         return 0;
     }
 
-    outputFile = generateFileName(directory, baseName, includeDate);
-
-    auto frameBuf = std::ifstream(FRAME_BUF_PATH, std::ios::binary);
-    if (not frameBuf.is_open()) {
-        std::cerr << "Failed to open frame buffer\n";
-        return 1;
+    if (runBench) {
+        return runBenchmark();
+    }
+    if (opts.outputFd == STDOUT_FILENO) {
+        // keep status messages out of the image data
+        std::cout.rdbuf(std::cerr.rdbuf());
     }
 
-    auto buffer565 = std::vector<RGB565>(WIDTH * HEIGHT);
-    frameBuf.read(
-        reinterpret_cast<char*>(buffer565.data()), // NOLINT (reinterpret_cast)
-        static_cast<long>(buffer565.size() * sizeof(RGB565))
-    );
-    if (not frameBuf) {
-        std::cerr << "Failed to read frame buffer\n";
+    // Root (of a setuid install) is only needed to open and map /dev/fb0. Any other file, e.g. a
+    // raw dump, and every output path, template, socket and recording is accessed as the user.
+    auto frameBuf = FrameBuffer();
+    if (opts.extractPath.empty()) {
+        if (opts.frameBufPath != FRAME_BUF_PATH && not dropPrivileges()) {
+            return 1;
+        }
+        if (not frameBuf.open(opts.frameBufPath.c_str())) {
+            return 1;
+        }
+    }
+    if (not dropPrivileges()) {
         return 1;
     }
+    if (not opts.extractPath.empty()) {
+        return extractRecording(opts);
+    }
 
-    auto buffer888 = convertRgb565ToRgb888(buffer565);
-    writePng(outputFile.c_str(), buffer888);
+    if (opts.continuous) {
+        return runContinuous(frameBuf, opts);
+    }
 
-    std::cout << "Screenshot saved as " << outputFile << "\n";
-    return 0;
-}
\ No newline at end of file
+    auto frame = opts.tearFree ? frameBuf.snapshot() : frameBuf.view();
+    auto writer = FrameWriter(opts);
+    auto full = Rect{0, 0, frame.format.width, frame.format.height};
+    return writer.save(frame, full, time(nullptr)) ? 0 : 1;
+}